@@ -37,6 +37,8 @@
 #ifndef CLUSTEREVALUATION_HPP_
 #define CLUSTEREVALUATION_HPP_
 
+#include "pcl_tools/segfast.hpp"
+
 
 #ifndef GTICK
 #define GTICK
@@ -81,6 +83,26 @@ void unwrapClusters(std::vector<std::vector<int> > &clusters, std::vector<int> &
 
 }
 
+//true if the two labelings split the points the same way, whatever numbers they gave the clusters.
+//a straight walk over the labels, instead of matching up clusters like matchclusterings does
+bool sameClustering(const ClusterLabels &l1, const ClusterLabels &l2){
+	if(l1.labels.size()!=l2.labels.size() || l1.size()!=l2.size()) return false;
+	std::vector<int> to2(l1.size(),-1),to1(l2.size(),-1);
+	for(uint i=0;i<l1.labels.size();++i){
+		int a=l1.labels[i], b=l2.labels[i];
+		if(a==-1 || b==-1){
+			if(a!=b) return false;
+			continue;
+		}
+		if(to2[a]==-1 && to1[b]==-1){
+			to2[a]=b;
+			to1[b]=a;
+		}
+		else if(to2[a]!=b || to1[b]!=a)
+			return false;
+	}
+	return true;
+}
 
 ////convert vector of PointIndices to a vector of vector of ints
 //void PItoVector(std::vector<pcl::PointIndices > &clusterin,std::vector<std::vector<int> > &clusterout ){
@@ -365,6 +387,45 @@ struct ClusterEvaluation{
 	    clusterings.back().ptime=g_tock(t0);
 	}
 
+	//the same, for algorithms that write a ClusterLabels.  only the clustering is timed, not unpacking it
+	void testAlgorithm(string suffix, void (*clusterfunc)(pcl::PointCloud<PointT> &, ClusterLabels &,double)){
+		ClusterLabels labels;
+		timeval t0=g_tick();
+		clusterfunc(smallcloud,labels,cluster_tol);
+		double ptime=g_tock(t0);
+		clusterings.push_back(clusterResults(suffix,cluster_tol));
+		labels.toClusters(clusterings.back().inds);
+	    clusterings.back().ptime=ptime;
+	}
+
+	//run one combination of EuclideanClusterEngine policies, so they can be compared against each other
+	template <typename Engine>
+	void testEngine(string suffix, Engine &engine){
+		timeval t0=g_tick();
+		clusterings.push_back(clusterResults(suffix,cluster_tol));
+		ClusterVectorSink sink(clusterings.back().inds);
+		engine.cluster(smallcloud,sink,cluster_tol);
+	    clusterings.back().ptime=g_tock(t0);
+	}
+
+	//cluster the cloud at each of the tolerances, by building one SingleLinkageTree up to the largest and cutting it.
+	//the results go in sweep, in the same order as tolerances, each with the time its cut took. returns the build time
+	double sweepTolerances(string suffix, std::vector<double> &tolerances, std::vector< clusterResults > &sweep){
+		sweep.clear();
+		if(!tolerances.size()) return 0;
+		timeval t0=g_tick();
+		SingleLinkageTree<PointT> tree;
+		tree.build(smallcloud,*std::max_element(tolerances.begin(),tolerances.end()));
+		double buildtime=g_tock(t0);
+		for(uint i=0;i<tolerances.size();++i){
+			t0=g_tick();
+			sweep.push_back(clusterResults(suffix,tolerances[i]));
+			tree.cut(tolerances[i],sweep.back().inds);
+			sweep.back().ptime=g_tock(t0);
+		}
+		return buildtime;
+	}
+
 
 	void evaluateResults(){
 		if(clusterings.size()<2) return;
@@ -0,0 +1,200 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2010, Garratt Gallagher
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name Garratt Gallagher nor the names of other
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+
+#ifndef PAIRDIST_HPP_
+#define PAIRDIST_HPP_
+
+#include "pcl/point_types.h"
+#include "pcl/point_cloud.h"
+#include <vector>
+#include <cmath>
+#include <limits>
+
+//the SSE kernels are used whenever the compiler targets SSE (always, on x86_64).
+//the AVX kernels are compiled in with a target attribute and picked at run time, so the
+//package does not need to be built with -mavx to use them, and still runs on machines without it.
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define PAIRDIST_SSE
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define PAIRDIST_AVX
+#endif
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b PointsSoA is a set of points with x, y and z in separate arrays, which is the layout the
+ * distance kernels below want.  Gather the candidate points into one of these, then test them in bulk.
+ * \author Garratt Gallagher
+ */
+struct PointsSoA{
+   std::vector<float> x,y,z;
+
+   void clear(){ x.clear(); y.clear(); z.clear(); }
+   int size() const { return x.size(); }
+
+   template <typename PointT>
+   void push_back(const PointT &p){
+      x.push_back(p.x);
+      y.push_back(p.y);
+      z.push_back(p.z);
+   }
+
+   //replace the contents with cloud.points[inds[i]]
+   template <typename PointT>
+   void gather(const pcl::PointCloud<PointT> &cloud, const std::vector<int> &inds){
+      x.resize(inds.size());
+      y.resize(inds.size());
+      z.resize(inds.size());
+      for(uint i=0;i<inds.size();++i){
+         const PointT &p=cloud.points[inds[i]];
+         x[i]=p.x;
+         y[i]=p.y;
+         z[i]=p.z;
+      }
+   }
+};
+
+
+namespace pairdist{
+
+//squared distances are computed in float, the same way pcl::squaredEuclideanDistance does.
+//this gives the float threshold t such that d <= t matches the double test d <= thresh
+inline float leThresh(double thresh){
+   float t=(float)thresh;
+   if((double)t > thresh) t=nextafterf(t,-std::numeric_limits<float>::infinity());
+   return t;
+}
+
+
+//index of the first of the n points within t (squared) of p, or -1
+inline int firstWithinScalar(float px, float py, float pz, const float *x, const float *y, const float *z, int n, float t){
+   for(int i=0;i<n;++i){
+      float dx=px-x[i], dy=py-y[i], dz=pz-z[i];
+      if(dx*dx+dy*dy+dz*dz <= t) return i;
+   }
+   return -1;
+}
+
+#ifdef PAIRDIST_SSE
+inline int firstWithinSSE(float px, float py, float pz, const float *x, const float *y, const float *z, int n, float t){
+   __m128 vx=_mm_set1_ps(px), vy=_mm_set1_ps(py), vz=_mm_set1_ps(pz), vt=_mm_set1_ps(t);
+   int i=0;
+   for(;i+4<=n;i+=4){
+      __m128 dx=_mm_sub_ps(vx,_mm_loadu_ps(x+i));
+      __m128 dy=_mm_sub_ps(vy,_mm_loadu_ps(y+i));
+      __m128 dz=_mm_sub_ps(vz,_mm_loadu_ps(z+i));
+      __m128 d=_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx),_mm_mul_ps(dy,dy)),_mm_mul_ps(dz,dz));
+      int mask=_mm_movemask_ps(_mm_cmple_ps(d,vt));
+      if(mask) return i+__builtin_ctz(mask);
+   }
+   int r=firstWithinScalar(px,py,pz,x+i,y+i,z+i,n-i,t);
+   return r<0 ? -1 : i+r;
+}
+#endif
+
+#ifdef PAIRDIST_AVX
+__attribute__((target("avx")))
+inline int firstWithinAVX(float px, float py, float pz, const float *x, const float *y, const float *z, int n, float t){
+   __m256 vx=_mm256_set1_ps(px), vy=_mm256_set1_ps(py), vz=_mm256_set1_ps(pz), vt=_mm256_set1_ps(t);
+   int i=0;
+   for(;i+8<=n;i+=8){
+      __m256 dx=_mm256_sub_ps(vx,_mm256_loadu_ps(x+i));
+      __m256 dy=_mm256_sub_ps(vy,_mm256_loadu_ps(y+i));
+      __m256 dz=_mm256_sub_ps(vz,_mm256_loadu_ps(z+i));
+      __m256 d=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx),_mm256_mul_ps(dy,dy)),_mm256_mul_ps(dz,dz));
+      int mask=_mm256_movemask_ps(_mm256_cmp_ps(d,vt,_CMP_LE_OQ));
+      if(mask) return i+__builtin_ctz(mask);
+   }
+   int r=firstWithinScalar(px,py,pz,x+i,y+i,z+i,n-i,t);
+   return r<0 ? -1 : i+r;
+}
+#endif
+
+
+typedef int (*FirstWithinFn)(float, float, float, const float *, const float *, const float *, int, float);
+
+//the widest kernels this cpu can run, chosen once on first use
+struct Kernels{
+   FirstWithinFn firstWithin;
+   const char *name;
+
+   Kernels(){
+      firstWithin=firstWithinScalar;
+      name="scalar";
+#ifdef PAIRDIST_SSE
+      firstWithin=firstWithinSSE;
+      name="sse";
+#endif
+#ifdef PAIRDIST_AVX
+      __builtin_cpu_init();
+      if(__builtin_cpu_supports("avx")){
+         firstWithin=firstWithinAVX;
+         name="avx";
+      }
+#endif
+   }
+};
+
+inline const Kernels &kernels(){
+   static Kernels k;
+   return k;
+}
+
+} //namespace pairdist
+
+
+//true if some point in a[astart, astart+na) and some point in b[bstart, bstart+nb) are within
+//squared distance thresh (inclusive) of each other.  returns as soon as one pair is found
+inline bool anyPairWithin(const PointsSoA &a, int astart, int na, const PointsSoA &b, int bstart, int nb, double thresh){
+   if(na<=0 || nb<=0) return false;
+   const pairdist::Kernels &k=pairdist::kernels();
+   float t=pairdist::leThresh(thresh);
+   //run the longer set through the vector lanes
+   if(na>nb){
+      for(int i=0;i<nb;++i)
+         if(k.firstWithin(b.x[bstart+i],b.y[bstart+i],b.z[bstart+i],&a.x[astart],&a.y[astart],&a.z[astart],na,t)>=0)
+            return true;
+      return false;
+   }
+   for(int i=0;i<na;++i)
+      if(k.firstWithin(a.x[astart+i],a.y[astart+i],a.z[astart+i],&b.x[bstart],&b.y[bstart],&b.z[bstart],nb,t)>=0)
+         return true;
+   return false;
+}
+
+#endif /* PAIRDIST_HPP_ */
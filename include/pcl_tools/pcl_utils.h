@@ -57,11 +57,16 @@
 #include "pcl/features/normal_3d.h"
 #include "pcl/features/normal_3d_omp.h"
 #include "pcl/kdtree/kdtree.h"
+#include "pcl/kdtree/kdtree_flann.h"
 //#include "pcl/kdtree/kdtree_ann.h"
 //#include "pcl/kdtree/organized_data.h"
 #include <list>
 #include <fstream>
 #include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/random/mersenne_twister.hpp>
 #include "Winsock2.h"
 
 //useful timing functions:
@@ -108,6 +113,151 @@ void removeOutliers(pcl::PointCloud<pcl::PointWithViewpoint> &cloudin, pcl::Poin
 void downSample(pcl::PointCloud<pcl::PointWithViewpoint> &cloudin, pcl::PointCloud<pcl::PointWithViewpoint> &cloudout, double leafsize=.01);
 
 
+//nearest point queries against one cloud, with the search tree built once in setInputCloud() and kept.
+//The batch forms answer a query for every point of refs, and write into arrays the caller owns (they are resized,
+//so keeping them between calls keeps their memory).  Distances are squared, as getClosestPoint gives them.
+//compiled in for PointXYZ, PointXYZINormal and PointWithViewpoint
+template <typename PointT>
+class NearestPoints{
+public:
+   NearestPoints(){}
+
+   //search cloud from now on.  the cloud is copied once, and the tree built over the copy
+   void setInputCloud(const pcl::PointCloud<PointT> &cloud);
+   //the same, keeping the caller's pointer instead of copying the cloud
+   void setInputCloud(const typename pcl::PointCloud<PointT>::ConstPtr &cloud);
+   const pcl::PointCloud<PointT> &getInputCloud() const { return *cloud_; }
+
+   //the index of the point closest to ref, or -1 if the cloud is empty.  sqrdist gets its squared distance
+   int nearest(const PointT &ref, float &sqrdist);
+   //the point closest to ref goes in point, and its squared distance is returned
+   double nearest(const PointT &ref, PointT &point);
+
+   //indices[i] is the point closest to refs.points[i], -1 if there is none
+   void nearest(const pcl::PointCloud<PointT> &refs, std::vector<int> &indices, std::vector<float> &sqrdists);
+   //the k closest points to each of refs, nearest first: those of refs.points[i] are indices[i*k] to
+   //indices[i*k+k-1].  if the cloud has fewer than k points the rest are -1, with a distance of infinity
+   void nearestK(const pcl::PointCloud<PointT> &refs, int k, std::vector<int> &indices, std::vector<float> &sqrdists);
+
+private:
+   typename pcl::PointCloud<PointT>::ConstPtr cloud_;
+   pcl::KdTreeFLANN<PointT> tree_;
+   std::vector<int> indices_;
+   std::vector<float> dists_;
+};
+
+//ICP in 2D (x, y and yaw) against a target that does not change, like a reference scan or a map.
+//The search tree over the target is built once, in setTarget(), and the correspondence buffers are kept between
+//iterations and calls, so aligning a stream of clouds against the same target never rebuilds or copies it.
+//The nearest neighbor searches are split across threads.  The sample is drawn up front from the object's own
+//random generator, so with setSeed() the correspondences (and so the alignment) are the same on every run,
+//whatever the number of threads.
+//compiled in for PointXYZ, PointXYZINormal and PointWithViewpoint
+template <typename PointT>
+class Icp2D{
+public:
+   std::vector<int> refpts,tgtpts;  //the correspondences found by the last getClosestPoints()
+
+   Icp2D(){ numthreads_=0; rng_.seed(getUsec()); targetversion_=0; searched_=0; generation_=0; pending_=0; stopping_=false; }
+   ~Icp2D(){ stopWorkers(); }
+
+   //make the sampling reproducible: the same seed and the same calls give the same correspondences
+   void setSeed(unsigned int seed){ rng_.seed(seed); }
+   //how many threads to search with. 0 uses one per core.  each search thread builds its own tree, so they only
+   //join in once the target has been searched for about as many points as it holds; a one-off align against a big
+   //target stays on the calling thread.  once started, they are kept until the number changes or the Icp2D goes away
+   void setNumThreads(int numthreads){ if(numthreads!=numthreads_) stopWorkers(); numthreads_=numthreads; }
+
+   //align to target from now on.  the cloud is copied once, and the tree built over the copy
+   void setTarget(const pcl::PointCloud<PointT> &target);
+   //the same, keeping the caller's pointer instead of copying the cloud
+   void setTarget(const typename pcl::PointCloud<PointT>::ConstPtr &target);
+   bool hasTarget() const { return (bool)target_; }
+   const pcl::PointCloud<PointT> &getTarget() const { return *target_; }
+
+   //find up to num_pts random points of ref_cloud with a point of the target within dist_thresh (and about the
+   //same height), and leave the pairs in refpts and tgtpts.  returns the number found
+   int getClosestPoints(const pcl::PointCloud<PointT> &ref_cloud, double dist_thresh=.2, uint num_pts=500);
+
+   //move c1 onto the target.  c1 is transformed in place, and the total transform is returned
+   Eigen::Matrix4f align(pcl::PointCloud<PointT> &c1, double max_dist, int small_transdiff_countreq=1, int num_pts=500,
+         uint min_pts=10, uint max_iter=50, float transdiff_thresh=.0001);
+
+private:
+   //a search thread of the pool. it has its own tree over the target, so no two threads share a search structure
+   struct Worker{
+      boost::shared_ptr<boost::thread> thread;
+      pcl::KdTreeFLANN<PointT> tree;
+      int targetversion;   //the target its tree was built over; rebuilt by the worker itself when it is behind
+      int generation;      //the last batch it was handed
+      int begin,end;       //its share of the current batch
+   };
+
+   Icp2D(const Icp2D &);  //the search threads point back at this object, so it can't be copied
+   Icp2D &operator=(const Icp2D &);
+
+   //look up the target point matching each of ref_cloud.points[candidates_[begin..end-1]], or -1 if there isn't one
+   void matchRange(pcl::KdTreeFLANN<PointT> &tree, const pcl::PointCloud<PointT> *ref_cloud, int begin, int end, double dist_thresh);
+   //search the batch in candidates_ with the calling thread and numthreads-1 workers
+   void matchParallel(const pcl::PointCloud<PointT> *ref_cloud, int batch, int numthreads, double dist_thresh);
+   void workerLoop(Worker *worker);
+   void stopWorkers();
+
+   typename pcl::PointCloud<PointT>::ConstPtr target_;
+   pcl::KdTreeFLANN<PointT> tree_;   //the calling thread's tree
+   int targetversion_;               //bumped by setTarget
+   long searched_;                   //points searched against this target so far
+   boost::mt19937 rng_;
+   int numthreads_;
+   std::vector<int> notused_,candidates_,matches_;
+
+   //the worker pool.  each batch bumps generation_ to wake the workers, and the last one to finish its share
+   //brings pending_ to 0 and wakes the caller
+   std::vector<boost::shared_ptr<Worker> > workers_;
+   boost::mutex poolmutex_;
+   boost::condition workready_,workdone_;
+   int generation_,pending_;
+   bool stopping_;
+   const pcl::PointCloud<PointT> *batchcloud_;
+   double batchthresh_;
+};
+
+//coarse to fine Icp2D.  The target is voxel downsampled into levels once, in setTarget(), each with its own tree.
+//align() downsamples the cloud the same way, and runs ICP from the coarsest level to the finest, each level starting
+//from where the last one left off.  The coarse levels are cheap and take out the big offsets, so only a few
+//iterations are needed at full resolution.  compiled in for PointXYZ, PointXYZINormal and PointWithViewpoint
+template <typename PointT>
+class Icp2DPyramid{
+public:
+   Icp2DPyramid(){}
+
+   //leafsizes go from coarsest to finest.  a leaf size of 0 is the cloud itself, and is usually the last level
+   void setTarget(const pcl::PointCloud<PointT> &target, const std::vector<double> &leafsizes);
+   int numLevels() const { return levels_.size(); }
+   Icp2D<PointT> &level(int l){ return *levels_[l]; }
+
+   //move c1 onto the target.  c1 is transformed in place, and the total transform is returned.
+   //max_dist is the correspondence distance at the coarsest level, and is halved at each finer level.
+   //the finest level runs at most fine_iter iterations, the others max_iter
+   Eigen::Matrix4f align(pcl::PointCloud<PointT> &c1, double max_dist, int small_transdiff_countreq=1, int num_pts=500,
+         uint min_pts=10, uint max_iter=50, uint fine_iter=5, float transdiff_thresh=.0001);
+
+private:
+   std::vector<double> leafsizes_;
+   std::vector<boost::shared_ptr<Icp2D<PointT> > > levels_;
+   pcl::PointCloud<PointT> source_;   //c1 at the current level
+};
+
+//point to plane ICP in 2D, using the target's normals (from getNormals).  Instead of fitting a full rigid transform
+//and projecting it down, each iteration solves for x, y and yaw directly with one Gauss-Newton step on the distances
+//from c1's points to the target's tangent planes, so it settles in a few iterations.  c1 is moved in place.
+//stops once a step moves less than transdiff_thresh (meters plus radians)
+Eigen::Matrix4f icp2DPointToPlane(Icp2D<pcl::PointXYZINormal> &icp, pcl::PointCloud<pcl::PointXYZINormal> &c1, double max_dist,
+     int num_pts=500, uint min_pts=10, uint max_iter=15, float transdiff_thresh=.0001);
+Eigen::Matrix4f icp2DPointToPlane(pcl::PointCloud<pcl::PointXYZINormal> &c1, pcl::PointCloud<pcl::PointXYZINormal> &c2, double max_dist,
+     int num_pts=500, uint min_pts=10, uint max_iter=15, float transdiff_thresh=.0001);
+
+
 void segfast(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::PointCloud<pcl::PointXYZ> > &cloud_clusters, double cluster_tol=.2);
 void segfast(pcl::PointCloud<pcl::PointXYZINormal> &cloud, std::vector<pcl::PointCloud<pcl::PointXYZINormal> > &cloud_clusters, double cluster_tol=.2);
 void segfast(pcl::PointCloud<pcl::PointWithViewpoint> &cloud, std::vector<pcl::PointCloud<pcl::PointWithViewpoint> > &cloud_clusters, double cluster_tol=.2);
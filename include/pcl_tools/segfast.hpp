@@ -40,10 +40,17 @@
 #include "pcl/io/pcd_io.h"
 #include "pcl/segmentation/extract_clusters.h"
 #include "pcl/features/feature.h"
-#include "nnn/nnn.hpp"
+#include "pcl_tools/spatialhash.hpp"
+#include "pcl_tools/pairdist.hpp"
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 #include <sys/time.h>
 #include <list>
 #include <fstream>
+#include <limits>
+#include <algorithm>
+#include <functional>
 
 using namespace std;
 
@@ -67,1254 +74,1852 @@ using namespace std;
 
 
 
-  //keeps  track of clustering result
-template <typename PointT>
-struct PtMap{
-	std::vector<int> ptindices; //map indices used in this struct to the outside (possibly to the real point cloud)
-	map<int,int> 	 rmap;  //this maps the outside indices to inside: i = rmap[ptindices[i]]
-							//note that o = ptindices[rmap[o]] might not work, since
-
-	double _cluster_tol;
-	pcl::PointCloud<PointT> *_cloud;
-	std::vector<int> clusterindices; //indicates which cluster each pt belongs to
-	std::vector<int> loners;  // the these are points who form their own cluster of one
-
-	//these are of size heads.size():
-	std::vector<int> heads;  // the index of the 'head' of each cluster, i.e where the radius search originated
-	std::vector<int> clusterindices2; //indicates which cluster each head belongs to
-	std::vector< std::vector<int> > pairings;
-	std::vector<int> initialgrabs; //counts how many pts each head initially gets
-   std::vector< std::vector<int> > tosearch; //list of pairs of heads that are candidates for merging
-   std::vector<float> farpt;  // the distance to the farthest point in the
-
-	//these are of size heads2.size()
-	std::vector<int> heads2;  // the index of the 'head' of each super cluster, i.e where the radius search originated
-	std::vector< std::vector<int> > clusters;  //the final clusters
-
-	SplitCloud2<PointT> *_sc2;
-
-
-	//debugging tools
-	std::vector<int> overlapcount; //counts how many radii a pt falls within
-	int randseed;
-
-	void setInds(std::vector<int> &inds){
-		ptindices=inds;
-		for(uint i=0;i<ptindices.size();i++)
-			rmap[ptindices[i]]=i;
-	}
+//disjoint-set forest used to keep track of which heads have been joined into the same cluster.
+//find() does path compression and join() does union-by-rank, so any sequence of merges is close to linear
+struct DisjointSets{
+   std::vector<int> parent;
+   std::vector<int> rank;
+   std::vector<int> weight;  //only kept up if weigh() was called: the total weight of the set, at its root
 
-	PtMap(pcl::PointCloud<PointT> &cloud, double cluster_tol){
-		_cloud=&cloud;
-		clusterindices.resize(_cloud->size(),-1);
-		_cluster_tol=cluster_tol;
-	}
+   void reset(int n){
+      parent.resize(n);
+      rank.assign(n,0);
+      weight.clear();
+      for(int i=0;i<n;++i) parent[i]=i;
+   }
 
+   //weigh element i as offsets[i+1]-offsets[i] (e.g. the number of points a head has, from a HeadGraph)
+   //and total them up by set. from then on join() keeps weight[find(i)] up to date
+   void weigh(const std::vector<int> &offsets){
+      weight.assign(parent.size(),0);
+      for(uint i=0;i<parent.size();++i)
+         weight[find(i)]+=offsets[i+1]-offsets[i];
+   }
 
-	//for when there is no special indexing:
-	void setInds(int s){
-		ptindices.resize(s);
-		for(uint i=0;i<ptindices.size();i++){
-			ptindices[i]=i;
-			rmap[i]=i;
-		}
-	}
-	int getUsec(){
-	     struct timeval tv;
-	     gettimeofday(&tv, NULL);
-	     return tv.tv_usec;
-	  }
-	//simply runs radius search to grab all the points nearby until everything is taken
-	//results in each pt assigned a label, and a list of who grabbed each point
-
-	void simpleDownsample(pcl::PointCloud<PointT> &cloud, double cluster_tol=.2){
-		if(!ptindices.size()) //if we haven't initialized pt indices, just use the cloud size
-			setInds(cloud.size());
-	   pcl::KdTreeFLANN<PointT> tree;
-	   tree.setInputCloud(cloud.makeShared(), boost::make_shared<std::vector<int> > (ptindices));
-	   vector<int> indices;
-	   vector<float> dists;
-	   heads.clear();
-	   overlapcount.resize(ptindices.size(),0);//DEBUG: count the number of overlaps
-
-
-
-      srand(getUsec());
-      //DEBUG:: test seeding randomly to begin with:
-      for(int j=0; j<randseed;j++){
-       int i = rand()%clusterindices.size();
-       if(clusterindices[i]==-1){    //if no one has claimed this point, make it a head
-         pairings.push_back(std::vector<int>());//DEBUG: keeping track of pairing
-         heads.push_back(i);
-         if(!tree.radiusSearch(cloud.points[ptindices[i]],cluster_tol,indices,dists))  //find all the points close to this point
-            ROS_WARN("radius search failed!");
-         initialgrabs.push_back(indices.size()); //DEBUG: count how many pts each head initially gets
-         for(uint j=0;j<indices.size();j++){
-            if(clusterindices[rmap[indices[j]]]>-1){ //DEBUG: if this pt is already claimed, it indicates a pairing
-               if(!count(pairings[heads.size()-1].begin(),pairings[heads.size()-1].end(),clusterindices[rmap[indices[j]]]))
-                  pairings[heads.size()-1].push_back(clusterindices[rmap[indices[j]]]);
-            }
-            clusterindices[rmap[indices[j]]]=heads.size()-1; //assign these points to the current head. this overwrites previous claims, but it's ok
-            overlapcount[rmap[indices[j]]]++;  //DEBUG: count the number of overlaps
+   int find(int i){
+      int root=i;
+      while(parent[root]!=root) root=parent[root];
+      while(parent[i]!=root){ //point everything on the path straight at the root
+         int next=parent[i];
+         parent[i]=root;
+         i=next;
+      }
+      return root;
+   }
+
+   //returns true if a and b were in different sets
+   bool join(int a, int b){
+      a=find(a); b=find(b);
+      if(a==b) return false;
+      if(rank[a]<rank[b]) std::swap(a,b);
+      parent[b]=a;
+      if(rank[a]==rank[b]) rank[a]++;
+      if(weight.size()) weight[a]+=weight[b];
+      return true;
+   }
 
+   //add a set holding just one new element, and return that element
+   int add(){
+      parent.push_back(parent.size());
+      rank.push_back(0);
+      if(weight.size()) weight.push_back(0);
+      return parent.size()-1;
+   }
 
-         }
-       }
-      }
-	   for(uint i=0; i<clusterindices.size();i++){
-		 if(clusterindices[i]==-1){    //if no one has claimed this point, make it a head
-			pairings.push_back(std::vector<int>());//DEBUG: keeping track of pairing
-			heads.push_back(i);
-			if(!tree.radiusSearch(cloud.points[ptindices[i]],cluster_tol,indices,dists))  //find all the points close to this point
-			   ROS_WARN("radius search failed!");
-			initialgrabs.push_back(indices.size()); //DEBUG: count how many pts each head initially gets
-			for(uint j=0;j<indices.size();j++){
-				if(clusterindices[rmap[indices[j]]]>-1){ //DEBUG: if this pt is already claimed, it indicates a pairing
-					if(!count(pairings[heads.size()-1].begin(),pairings[heads.size()-1].end(),clusterindices[rmap[indices[j]]]))
-						pairings[heads.size()-1].push_back(clusterindices[rmap[indices[j]]]);
-				}
-				clusterindices[rmap[indices[j]]]=heads.size()-1; //assign these points to the current head. this overwrites previous claims, but it's ok
-				overlapcount[rmap[indices[j]]]++;  //DEBUG: count the number of overlaps
+   int size(){ return parent.size(); }
+};
 
 
-			}
-		 }
-	   }
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b SegfastStats is what one segfast call measured: how long each phase took (in seconds),
+ * how much searching and merging it did, and what it ended up with.  Pass one in to have it filled out.
+ */
+struct SegfastStats{
+	double reordertime;    //sorting the cloud into Morton order, if that was asked for
+	double downsampletime; //picking heads and grabbing the points around them
+	double pairingtime;    //joining heads that grabbed the same point
+	double indextime;      //indexing the heads
+	double mergetime;      //checking the clustering for missed merges
+	double totaltime;
+	int searchcount;       //radius searches, over all the phases
+	int comparecount;      //point set against point set comparisons while looking for merges
+	int mergecount;        //merges found while checking the clustering
+	int numpoints,numheads,numloners,numclusters;
+
+	SegfastStats(){ clear(); }
+
+	void clear(){
+		reordertime=downsampletime=pairingtime=indextime=mergetime=totaltime=0;
+		searchcount=comparecount=mergecount=0;
+		numpoints=numheads=numloners=numclusters=0;
 	}
 
+	void print(std::ostream &out=std::cout) const{
+		out<<"segfast: "<<numpoints<<" pts, "<<numheads<<" heads, "<<numloners<<" loners -> "<<numclusters<<" clusters in "<<totaltime
+		   <<" (reorder "<<reordertime<<", downsample "<<downsampletime<<", pairings "<<pairingtime<<", index "<<indextime<<", merge "<<mergetime<<")  "
+		   <<searchcount<<" searches, "<<comparecount<<" compares, "<<mergecount<<" merges"<<std::endl;
+	}
+};
 
-   //simply runs radius search to grab all the points nearby until everything is taken
-   //results in each pt assigned a label, and a list of who grabbed each point
 
-   void simpleDownsample2(pcl::PointCloud<PointT> &cloud, double cluster_tol=.2){
-      timeval t0=g_tick();
-      if(!ptindices.size()) //if we haven't initialized pt indices, just use the cloud size
-         setInds(cloud.size());
-      std::cout<<"  setinds took "<<g_tock(t0)<<endl; t0=g_tick();
-      pcl::KdTreeFLANN<PointT> tree;
-      tree.setInputCloud(cloud.makeShared(), boost::make_shared<std::vector<int> > (ptindices));
-
-      std::cout<<"  setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-      vector<int> indices;
-      vector<float> dists;
-      heads.clear();
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b ClusterStats accumulates the count, sum, sum of outer products and bounding box of a set of points,
+ * so the centroid, covariance and extent of a cluster come out of the same pass that labels its points.
+ */
+struct ClusterStats{
+	int count;
+	Eigen::Vector3d sum;
+	Eigen::Matrix3d sumsq;   //sum of p*p^T
+	Eigen::Vector3f minpt,maxpt;
+
+	ClusterStats(){ clear(); }
+
+	void clear(){
+		count=0;
+		sum.setZero();
+		sumsq.setZero();
+		minpt.setConstant(std::numeric_limits<float>::max());
+		maxpt.setConstant(-std::numeric_limits<float>::max());
+	}
 
-      int searchcount=0;
-      for(uint i=0; i<clusterindices.size();i++){
-       if(clusterindices[i]==-1){    //if no one has claimed this point, make it a head
-         heads.push_back(i);
-         searchcount++;
-         if(!tree.radiusSearch(cloud.points[ptindices[i]],cluster_tol,indices,dists))  //find all the points close to this point
-            ROS_WARN("radius search failed!");
-         for(uint j=0;j<indices.size();j++){
-            clusterindices[rmap[indices[j]]]=heads.size()-1; //assign these points to the current head. this overwrites previous claims, but it's ok
+	template <typename PointT>
+	inline void add(const PointT &p){
+		count++;
+		sum(0)+=p.x; sum(1)+=p.y; sum(2)+=p.z;
+		sumsq(0,0)+=p.x*(double)p.x; sumsq(0,1)+=p.x*(double)p.y; sumsq(0,2)+=p.x*(double)p.z;
+		sumsq(1,1)+=p.y*(double)p.y; sumsq(1,2)+=p.y*(double)p.z; sumsq(2,2)+=p.z*(double)p.z;
+		if(p.x<minpt(0)) minpt(0)=p.x;
+		if(p.y<minpt(1)) minpt(1)=p.y;
+		if(p.z<minpt(2)) minpt(2)=p.z;
+		if(p.x>maxpt(0)) maxpt(0)=p.x;
+		if(p.y>maxpt(1)) maxpt(1)=p.y;
+		if(p.z>maxpt(2)) maxpt(2)=p.z;
+	}
 
-         }
-       }
-      }
-      std::cout<<"  searching took "<<g_tock(t0)<<" for "<<searchcount<<" searches"<<endl;
+	//same as compute3DCentroid on the points
+	Eigen::Vector4f centroid() const{
+		Eigen::Vector4f c(0,0,0,0);
+		if(!count) return c;
+		c.head<3>()=(sum/count).cast<float>();
+		return c;
+	}
 
-   }
+	//same as computeCovarianceMatrixNormalized on the points, about their centroid
+	Eigen::Matrix3f covariance() const{
+		Eigen::Matrix3d cov=Eigen::Matrix3d::Zero();
+		if(!count) return cov.cast<float>();
+		Eigen::Vector3d mean=sum/count;
+		cov=sumsq/count;   //only the upper triangle has been accumulated
+		cov(1,0)=cov(0,1); cov(2,0)=cov(0,2); cov(2,1)=cov(1,2);
+		cov-=mean*mean.transpose();
+		return cov.cast<float>();
+	}
+};
 
+//fill in one ClusterStats per cluster, for clusterings that did not produce them as they went
+template <typename PointT>
+void computeClusterStats(const pcl::PointCloud<PointT> &cloud, const std::vector<std::vector<int> > &clusters, std::vector<ClusterStats> &stats){
+	stats.resize(clusters.size());
+	for(uint c=0;c<clusters.size();++c){
+		stats[c].clear();
+		for(uint i=0;i<clusters[c].size();++i)
+			stats[c].add(cloud.points[clusters[c][i]]);
+	}
+}
 
-   //simply runs radius search to grab all the points nearby until everything is taken
-   //results in each pt assigned a label, and a list of who grabbed each point
 
-   void simpleDownsampleNNN2(pcl::PointCloud<PointT> &cloud, double cluster_tol=.2){
-      timeval t0=g_tick();
-//      if(!ptindices.size()) //if we haven't initialized pt indices, just use the cloud size
-//         setInds(cloud.size());
-//      std::cout<<"  setinds took "<<g_tock(t0)<<endl; t0=g_tick();
-      _sc2 =  new SplitCloud2<PointT>(cloud,3.0*cluster_tol);
-      std::cout<<"  setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-      vector<int> indices;
-      vector<float> dists;
-      heads.clear();
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b ClusterLimits says which clusters to keep: those with between minsize and maxsize points, and of those
+ * only the topk largest (0 keeps them all).  It converts from an int, so passing min_pts_per_cluster still works.
+ * The clustering routines enforce the limits before any cluster's point list is built, and skip the border checks
+ * between clusters that are already too big to be kept.
+ */
+struct ClusterLimits{
+	int minsize,maxsize,topk;
+
+	ClusterLimits(int _minsize=1, int _maxsize=std::numeric_limits<int>::max(), int _topk=0)
+		:minsize(_minsize),maxsize(_maxsize),topk(_topk){}
+
+	bool keeps(int size) const { return size>=minsize && size<=maxsize && size>0; }
+	bool bounded() const { return maxsize<std::numeric_limits<int>::max(); }
+
+	//whether the sets with roots ra and rb are both already over maxsize, so the check between them can be skipped:
+	//they are dropped whether they join or not.  sets has to have been weighed with the point counts if bounded()
+	bool bothTooBig(const DisjointSets &sets, int ra, int rb) const {
+		return bounded() && sets.weight[ra]>maxsize && sets.weight[rb]>maxsize;
+	}
 
-      int searchcount=0;
-      for(uint i=0; i<clusterindices.size();i++){
-       if(clusterindices[i]==-1){    //if no one has claimed this point, make it a head
-           pairings.push_back(std::vector<int>());//DEBUG: keeping track of pairing
-         heads.push_back(i);
-         searchcount++;
-//         initialgrabs.push_back(_sc2->AssignInds(cloud.points[i],clusterindices,cluster_tol,heads.size()-1));  //find all the points close to this point
-         _sc2->NNN(cloud.points[i],indices,dists,cluster_tol);  //find all the points close to this point
-         initialgrabs.push_back(indices.size());
-         float maxdist;
-         for(uint j=0;j<indices.size();j++){
-            if(j==0 || maxdist<dists[j]) maxdist=dists[j];
-            if(clusterindices[indices[j]]>-1){ //DEBUG: if this pt is already claimed, it indicates a pairing
-				if(!count(pairings.back().begin(),pairings.back().end(),clusterindices[indices[j]]))
-					pairings.back().push_back(clusterindices[indices[j]]);
+	//given the size of each cluster, set the ones that are not kept to -1. returns how many are kept.
+	//with a topk, clusters bigger than the k-th largest are all kept, and ties at that size are kept in order until
+	//there are k.  ranked is scratch
+	int pick(std::vector<int> &sizes, std::vector<int> &ranked) const{
+		int cutoff=0,ties=std::numeric_limits<int>::max();
+		if(topk>0){
+			ranked.clear();
+			for(uint l=0;l<sizes.size();++l)
+				if(keeps(sizes[l])) ranked.push_back(sizes[l]);
+			if((int)ranked.size()>topk){
+				std::nth_element(ranked.begin(),ranked.begin()+topk-1,ranked.end(),std::greater<int>());
+				cutoff=ranked[topk-1];
+				ties=topk;
+				for(uint r=0;r<ranked.size();++r)
+					if(ranked[r]>cutoff) ties--;
 			}
-            clusterindices[indices[j]]=heads.size()-1; //assign these points to the current head. this overwrites previous claims, but it's ok
+		}
+		int kept=0;
+		for(uint l=0;l<sizes.size();++l)
+			if(keeps(sizes[l]) && sizes[l]>=cutoff && (sizes[l]>cutoff || ties-- > 0))
+				kept++;
+			else
+				sizes[l]=-1;
+		return kept;
+	}
+};
 
-//			overlapcount[indices[j]]++;  //DEBUG: count the number of overlaps
-         }
-         farpt.push_back(sqrt(maxdist));
-       }
-      }
-      std::cout<<"  searching took "<<g_tock(t0)<<" for "<<searchcount<<" searches"<<endl;
 
-   }
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b ClusterLabels is the flat form of a clustering: the cluster of each point, plus the points of each
+ * cluster packed end to end (compressed sparse rows).  Keep one around and pass it back in, and the clustering
+ * routines fill it in place without allocating anything once it has grown to the size of the clouds.
+ */
+struct ClusterLabels{
+	std::vector<int> labels;   //cluster of each point, -1 if it is not in one
+	std::vector<int> offsets;  //the points of cluster c are indices[offsets[c]] to indices[offsets[c+1]-1]
+	std::vector<int> indices;
+	std::vector<int> remap;    //scratch for finish()
+	std::vector<int> ranked;
+
+	ClusterLabels(){ clear(); }
+	void clear(){ labels.clear(); offsets.assign(1,0); indices.clear(); }
+
+	int size() const { return offsets.size()-1; }
+	int begin(int c) const { return offsets[c]; }
+	int end(int c) const { return offsets[c+1]; }
+	int clusterSize(int c) const { return offsets[c+1]-offsets[c]; }
+
+	//once labels holds a label in [0,numlabels) or -1 for each point: drop the clusters outside the limits,
+	//number the rest in order, and pack their points (in increasing index order) into offsets/indices.
+	//returns the number of clusters
+	int finish(int numlabels, const ClusterLimits &limits=ClusterLimits()){
+		return finish(numlabels,limits,(const pcl::PointCloud<pcl::PointXYZ>*)NULL,NULL);
+	}
 
-   //simply runs radius search to grab all the points nearby until everything is taken
-   //results in each pt assigned a label, and a list of who grabbed each point
+	//the same, and if clusterstats is given, fill in the ClusterStats of each cluster from cloud as its points are packed
+	template <typename PointT>
+	int finish(int numlabels, const ClusterLimits &limits, const pcl::PointCloud<PointT> *cloud, std::vector<ClusterStats> *clusterstats){
+		remap.assign(numlabels,0);
+		for(uint i=0;i<labels.size();++i)
+			if(labels[i]!=-1) remap[labels[i]]++;
+		limits.pick(remap,ranked);
+		offsets.resize(1);
+		for(int l=0;l<numlabels;++l)
+			if(remap[l]!=-1){
+				offsets.push_back(offsets.back()+remap[l]);
+				remap[l]=offsets.size()-2;
+			}
+			else
+				remap[l]=-1;
+		indices.resize(offsets.back());
+		for(uint i=0;i<labels.size();++i){
+			if(labels[i]==-1) continue;
+			labels[i]=remap[labels[i]];
+		}
+		//now remap holds each cluster's next free spot
+		remap.assign(offsets.begin(),offsets.end()-1);
+		if(clusterstats){
+			clusterstats->resize(size());
+			for(int c=0;c<size();++c)
+				(*clusterstats)[c].clear();
+		}
+		for(uint i=0;i<labels.size();++i)
+			if(labels[i]!=-1){
+				indices[remap[labels[i]]++]=i;
+				if(clusterstats) (*clusterstats)[labels[i]].add(cloud->points[i]);
+			}
+		return size();
+	}
 
-   void simpleDownsampleNNN(pcl::PointCloud<PointT> &cloud, double cluster_tol=.2){
-      timeval t0=g_tick();
-      std::cout<<"  setinds took "<<g_tock(t0)<<endl; t0=g_tick();
-      SplitCloud<PointT> sc(cloud,cluster_tol);
-      std::cout<<"  setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-      vector<int> indices;
-      vector<float> dists;
-      heads.clear();
+	//the same clustering, as a vector of vector of ints
+	void toClusters(std::vector<std::vector<int> > &clusters) const{
+		clusters.resize(size());
+		for(int c=0;c<size();++c)
+			clusters[c].assign(indices.begin()+offsets[c],indices.begin()+offsets[c+1]);
+	}
 
-      int searchcount=0;
-      for(uint i=0; i<clusterindices.size();i++){
-       if(clusterindices[i]==-1){    //if no one has claimed this point, make it a head
-         heads.push_back(i);
-         searchcount++;
-         sc.NNN(cloud.points[i],indices,cluster_tol);  //find all the points close to this point
-         for(uint j=0;j<indices.size();j++){
-            clusterindices[indices[j]]=heads.size()-1; //assign these points to the current head. this overwrites previous claims, but it's ok
-         }
-       }
-      }
-      std::cout<<"  searching took "<<g_tock(t0)<<" for "<<searchcount<<" searches"<<endl;
+	//take the clustering from a vector of vector of ints. numpoints is the size of the cloud; points in no cluster get -1
+	void fromClusters(const std::vector<std::vector<int> > &clusters, int numpoints){
+		labels.assign(numpoints,-1);
+		for(uint c=0;c<clusters.size();++c)
+			for(uint i=0;i<clusters[c].size();++i)
+				labels[clusters[c][i]]=c;
+		finish(clusters.size());
+	}
+};
 
-   }
 
+//a graph over the heads, in compressed sparse row form: the neighbors of head h are edges[offsets[h]] to
+//edges[offsets[h+1]-1].  The owner fills offsets and edges in directly
+struct HeadGraph{
+	std::vector<int> offsets,edges;
 
-//The next step in clustering: cluster the heads
-   void headCluster(){
-	      timeval t0=g_tick();
-	      pcl::KdTreeFLANN<PointT> tree2;
-	   tree2.setInputCloud(_cloud->makeShared(),boost::make_shared<std::vector<int> >  (heads));
-	      std::cout<<"  setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-	   int searching,currenthead;
-	      vector<int> indices;
-	      vector<float> dists;
-	      heads2.clear();
-	   //heads2 is the cluster id.  we now search to make sure we check all the points in our cluster
-	   //minitree2 corresponds to the heads array, so the points in minitree2 are at heads[i]
-//	   std::vector<int> heads2;
-	   clusterindices2.resize(heads.size(),-1);
-	   std::list<int> tosearch;
-	      int searchcount=0;
-	   for(uint i=0; i<clusterindices2.size();i++){
-	     if(clusterindices2[i]==-1){
-	        heads2.push_back(heads[i]);
-	        tosearch.push_back(i);
-	        currenthead=heads2.size()-1; //references an index in heads2
-	        clusterindices2[i]=currenthead;
-	        while(tosearch.size()>0){
-	           searching=tosearch.front();
-	           tosearch.pop_front();
-	           searchcount++;
-	           if(!tree2.radiusSearch(_cloud->points[heads[searching]],_cluster_tol,indices,dists))
-	              cout<<"radius search failed!"<<endl;
-	           for(uint j=0;j<indices.size();j++)
-	              if(clusterindices2[indices[j]]==-1){//found untouched point (which means this root touched it)
-	                 clusterindices2[indices[j]]=currenthead; //claim it
-	                 tosearch.push_back(indices[j]);   //add it to list of points to search
-	              }
-	        }
-	     }
-	   }
-	      std::cout<<"  searching took "<<g_tock(t0)<<" for "<<searchcount<<" searches, getting "<<heads2.size()<<"  clusters"<<endl;
-   }
+	HeadGraph(){ clear(); }
+	void clear(){ offsets.assign(1,0); edges.clear(); }   //keeps the capacity
+	int rows() const { return offsets.size()-1; }
+	int begin(int h) const { return offsets[h]; }
+	int end(int h) const { return offsets[h+1]; }
+};
 
-   void headClusterNNN(){
-	      timeval t0=g_tick();
-
-//	      SplitCloud2 sc2(*_cloud,_cluster_tol);
-//	      std::cout<<"  setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-	      _sc2->useInds(heads);
-	      std::cout<<"  setupcloud2 took "<<g_tock(t0)<<endl; t0=g_tick();
-	   int searching,currenthead;
-	      vector<int> indices;
-	      vector<float> dists;
-	      heads2.clear();
-	   //heads2 is the cluster id.  we now search to make sure we check all the points in our cluster
-	   //minitree2 corresponds to the heads array, so the points in minitree2 are at heads[i]
-//	   std::vector<int> heads2;
-	   clusterindices2.resize(heads.size(),-1);
-	   std::list<int> tosearch;
-	      int searchcount=0;
-	   for(uint i=0; i<clusterindices2.size();i++){
-	     if(clusterindices2[i]==-1){
-	        heads2.push_back(heads[i]);
-	        tosearch.push_back(i);
-	        currenthead=heads2.size()-1; //references an index in heads2
-	        clusterindices2[i]=currenthead;
-	        while(tosearch.size()>0){
-	           searching=tosearch.front();
-	           tosearch.pop_front();
-	           searchcount++;
-	           _sc2->NNN(_cloud->points[heads[searching]],indices,_cluster_tol,true);
-	           for(uint j=0;j<indices.size();j++)
-	              if(clusterindices2[indices[j]]==-1){//found untouched point (which means this root touched it)
-	                 clusterindices2[indices[j]]=currenthead; //claim it
-	                 tosearch.push_back(indices[j]);   //add it to list of points to search
-	              }
-	        }
-	     }
-	   }
-	      std::cout<<"  searching took "<<g_tock(t0)<<" for "<<searchcount<<" searches, getting "<<heads2.size()<<"  clusters"<<endl;
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b BorderCheck says exactly whether the points grabbed by two heads have a pair within cluster_tol,
+ * stopping at the first pair it finds.  Each side is first cut down to the points that can reach the other head's
+ * ball (its center and how far it grabbed), which is usually a thin shell facing the other head.  Small shells are
+ * compared all against all with the vector kernels; big ones go through a grid on one side, so the cost stays
+ * about linear in the number of points instead of growing with their product.
+ */
+struct BorderCheck{
+   PointsSoA soa1,soa2;
+   std::vector<int> inds2,found;
+   HashGrid grid;
+   int gridthresh;   //above this many point pairs, use the grid
+
+   BorderCheck(){ gridthresh=4096; }
+
+   //points a[0..na-1] were grabbed by head ha, which reached out to ra; same for b.  all are cloud indices
+   template <typename PointT>
+   bool touches(const pcl::PointCloud<PointT> &cloud, const int *a, int na, const PointT &ha, float ra,
+         const int *b, int nb, const PointT &hb, float rb, double cluster_tol){
+      //only points within cluster_tol of the other head's ball can be in a close pair.  the slack covers rounding
+      float reachb=(rb+cluster_tol)*(1.0+1e-5), reacha=(ra+cluster_tol)*(1.0+1e-5);
+      reachb*=reachb;
+      reacha*=reacha;
+      soa1.clear();
+      for(int i=0;i<na;++i)
+         if(pcl::squaredEuclideanDistance(cloud.points[a[i]],hb) <= reachb)
+            soa1.push_back(cloud.points[a[i]]);
+      if(!soa1.size()) return false;
+      inds2.clear();
+      for(int i=0;i<nb;++i)
+         if(pcl::squaredEuclideanDistance(cloud.points[b[i]],ha) <= reacha)
+            inds2.push_back(b[i]);
+      if(!inds2.size()) return false;
+
+      double distthresh=cluster_tol*cluster_tol;
+      if((double)soa1.size()*inds2.size() <= gridthresh){
+         soa2.gather(cloud,inds2);
+         return anyPairWithin(soa1,0,soa1.size(),soa2,0,soa2.size(),distthresh);
+      }
+      if(!grid.build(cloud,&inds2,cluster_tol)){
+         //too spread out for a grid this fine: check every pair
+         soa2.gather(cloud,inds2);
+         return anyPairWithin(soa1,0,soa1.size(),soa2,0,soa2.size(),distthresh);
+      }
+      for(int i=0;i<soa1.size();++i){
+         found.clear();
+         grid.search(soa1.x[i],soa1.y[i],soa1.z[i],cluster_tol,found,NULL);
+         if(found.size()) return true;
+      }
+      return false;
    }
-
-void recomputeClusters(){
-	clusters.clear();
-    clusters.resize(heads2.size());
-    //now, for each point in the cloud find its head --> then the head it clustered to. that is its cluster id!
-    for(uint j=0;j<clusterindices.size();j++){
-    	clusters[clusterindices2[clusterindices[j]]].push_back(j);
-    }
-}
-
-
-//go through the heads and extract every one that initially only grabbed one pt.
-//these heads will never be joined with other heads
-//this provides a big speedup when dealing with small cluster tolerances
-void swapOutLoners(){
-	   std::vector< int> tempheads(heads.size());
-	   std::vector< int> headsremap(heads.size());
-	   loners.resize(heads.size());
-	   int numloners=0,numheads=0;
-	   for(uint i=0;i<heads.size();++i)
-		   if(initialgrabs[i] == 1){
-			 loners[numloners++]=heads[i];
-			 clusters[clusterindices2[i]].clear();
-			 headsremap[i]=-1;
-		   }
-		   else{
-			 headsremap[i]=numheads;
-			 tempheads[numheads++]=heads[i];
-		   }
-
-//	   heads.swap(tempheads);
-//	   heads.resize(numheads);
-	   loners.resize(numloners);
-	   std::vector< int> heads2remap(clusters.size());
-
-	   //now redo clusterindices2, and clusters:
-	   std::vector< std::vector<int> > clusters2(clusters.size());
-	   int numclusters=0;
-	   for(uint i=0; i<clusters.size();++i)
-		   if(clusters[i].size()){
-				heads2remap[i]=numclusters;
-				clusters[i].swap(clusters2[numclusters++]);
-		   }
-		   else{
-				heads2remap[i]=-1;
-		   }
-
-	   clusters.swap(clusters2);
-	   clusters.resize(numclusters);
-
-	   for(uint i=0;i<clusterindices2.size();++i)
-		   clusterindices2[i]=heads2remap[clusterindices2[i]];
-
-
-	   //sanity check. takes a while...
-	   std::cout<<numloners<<" loners."<<std::endl;
-//	   for(uint i=0;i<loners.size();++i){
-//		   int lcluster=clusterindices2[clusterindices[loners[i]]];
-//		   int lhead=clusterindices[loners[i]];
-//		   for(uint j=0;j<clusterindices2.size();++j){
-//			   if(clusterindices2[j]==lcluster && j!=lhead){
-//				   cout<<"head "<<j<<" is in the same sluster as a loner, head "<<lhead<<endl;
-//			   }
-//
-//		   }
-//
-//	   }
-
-}
-
-//adds all the single point clusters back in to the main clusters array
-void addLonersBack(){
-	for(uint i=0;i<loners.size();++i)
-		clusters.push_back(vector<int>(1,loners[i]));
-}
+};
 
 
-int analyzePairings(){
-	std::vector<int> clustering(pairings.size(),-1);
-//	clustering.resize(pairings.size(),-1);
-	int numclusters=0;
-	std::vector<int> tosee,seen;
-//	std::vector< std::vector<int> > clusters(pairings.size());
-	clusters.clear();
-	clusters.resize(pairings.size());
-	int current;
-//	for(int i=300; i >=0; i--){
-		for(int i=pairings.size()-1; i >=0; i--){
-		if(clustering[i]!=-1) continue;
-		if(pairings[i].size()==0){//it saw no marked pts
-			clusters[numclusters].push_back(i);
-			clustering[i]=numclusters++;
-			continue;
-		}
-		clusters[numclusters].push_back(i);
-		clustering[i]=numclusters;
-		tosee=pairings[i];
-		while(tosee.size()){
-			current=tosee.back();
-			tosee.pop_back();
-			if(clustering[current]!=numclusters){ //if we haven't seen this one before in this tree
-//				seen.push_back(current);
-				//see if we just discovered a previously explored tree:
-				if(clustering[current] != -1){ //yes, we did!
-					//this tree is fully explored, so send all the nodes to the seen
-					//clustering gives the index of the clusters array
-					int oldind=clustering[current];
-					for(uint j=0;j<clusters[oldind].size();j++){
-						clustering[clusters[oldind][j]]=numclusters; //mark all the heads in the found cluster with the new mark
-					}
-					//copy all of the points in the found cluster into this one
-					clusters[numclusters].insert(clusters[numclusters].end(),clusters[oldind].begin(),clusters[oldind].end());
-					clusters[oldind].clear();
-				}
-				else{
-					clusters[numclusters].push_back(current);
-					if(pairings[current].size())
-						tosee.insert(tosee.end(),pairings[current].begin(),pairings[current].end());
-				}
-				//now mark the current head as ours:
-				clustering[current]=numclusters;
-			}
-		}
-		//finished exploring.  increment and continue
-		numclusters++;
-	}
-	clusters.resize(numclusters);
-	clusterindices2=clustering;
-	return numclusters;
-//	printAll("points in cluster ",".",clustering);
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The clustering engine.  The head based clusterings in here all work the same way: pick heads that each grab the
+// points around them, join heads within cluster_tol of each other, check the gaps between nearby heads that did not
+// get joined for clusters that should have, and write out the result.  EuclideanClusterEngine runs those steps with
+// the spatial index, the head picking, the gap check and the output each a policy, so a change to one of them
+// reaches every clustering built on it, and the combinations can be timed against each other.
 //
+// An index policy has setInputCloud(cloudptr), search(pt,radius,indices,dists) over the cloud, and
+// setHeads(heads) / searchHeads(pt,radius,indices,dists) over the heads, which returns positions in heads.
+// A seed policy has grabRadius(tol) and seed(engine,cloud,tol), which fills in engine.heads, owner and reach
+// through engine.addHead(), and may join heads it knows are together.
+// A merge policy has check(engine,cloud,tol,ha,hb), which joins the clusters of heads ha and hb if they touch
+// (and any others it happens to find touching), and returns whether ha and hb ended up together.
+// A sink has labels(), the ClusterLabels the engine should write into, clusterStats(), where the engine should put
+// the ClusterStats of each cluster as it packs them (or NULL), and write(cloud,labels) to finish up.
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-}
+//for wrapping a cloud the caller owns in a shared pointer, without copying it or taking it over.  The engine only
+//searches the cloud while cluster() runs, so the pointer never outlives the cloud where it is used
+struct NullDeleter{
+   void operator()(const void *) const {}
+};
 
+/** \brief @b HashIndex answers the engine's searches with a SpatialHash.  Kept between calls, it reuses its buffers. */
+template <typename PointT>
+struct HashIndex{
+   SpatialHash<PointT> hash;
 
-void checkClustering(int min_pts_per_cluster=1){
-	recomputeClusters();
-	int zeroclusters=0;
-	for(uint i=0;i<clusters.size();i++)
-		if(clusters[i].size()==1)
-			zeroclusters++;
-	ROS_INFO("%d zero sized clusters",zeroclusters);
-   //now we need to check to see if any of the heads that were NOT clustered together are closer than cluster_tol+smaller_tol.
-   //This covers the exception noted in the code block above
-   //this is where an adversary could really kill this algorithm, since this check could be polynomial in cloud size. in real circumstances, it is very quick.
-   vector<int> indices1;
-   vector<int> indices;
-   int searchcount=0,comparecount=0,mergecount=0;
-   double distthresh=_cluster_tol*_cluster_tol; //radius search gives squared distances...
-//   double automergethresh=_cluster_tol*_cluster_tol/4.0; //pts are always in same cluster if they are both less than half the tolerance away from the same point
-   timeval t1,t0=g_tick();
-   double time1,time2;
-//   bool verbose=false;
-   for(uint i=0; i<clusterindices2.size();i++){ //for every head
-      _sc2->NNN(_cloud->points[heads[i]],indices,2.0*_cluster_tol,true);
-	  for(uint j=0;j<indices.size();j++){ //for every head that is close to this head
-		 if(clusterindices2[indices[j]] != clusterindices2[i] && indices[j] > i){//if the two heads are not in the same cluster (and only check each combo once)
-
-			//now we have to find if there is a point between head a and head b that is < cluster_tol from both
-			//our best chance of finding it is to start searching at a point halfway between them
-			PointT heada=_cloud->points[heads[i]], headb=_cloud->points[heads[indices[j]]];
-			PointT inbetween;
-			inbetween.x=(heada.x+headb.x)/2.0;
-			inbetween.y=(heada.y+headb.y)/2.0;
-			inbetween.z=(heada.z+headb.z)/2.0;
-			searchcount++;
-			t1=g_tick();
-		    _sc2->NNN(inbetween,indices1,_cluster_tol); //search on the full tree
-			time2+=g_tock(t1);
-		    if(!indices1.size())
-		    	continue;
-			//must match all points that return against each other
-			bool shouldmerge=false;
-			int mergefrom,mergeinto;
-			t1=g_tick();
-			for(int k=0;k<((int)indices1.size())-1;k++){
-				for(uint m=k+1;m<indices1.size();m++){
-					if(clusterindices2[clusterindices[indices1[k]]] != clusterindices2[clusterindices[indices1[m]]]  && (clusterindices2[clusterindices[indices1[k]]] == clusterindices2[i] || clusterindices2[clusterindices[indices1[m]]] ==clusterindices2[i] )){ //if different clusters
-						comparecount++;
-						if((pcl::squaredEuclideanDistance(_cloud->points[indices1[k]],_cloud->points[indices1[m]] ) < distthresh)){
-						   mergefrom=clusterindices2[clusterindices[indices1[k]]];
-						   mergeinto=clusterindices2[clusterindices[indices1[m]]];
-						   if(!((mergefrom !=clusterindices2[i] && mergefrom !=clusterindices2[indices[j]]) || (mergeinto !=clusterindices2[i] && mergeinto !=clusterindices2[indices[j]]))){
-							   shouldmerge=true;
-								mergecount++;
-							   break;  //TODO: shouldn't actually break, but rather see if multiple clusters should merge
-						   }
-//						   else
-//							   ROS_ERROR("Found another cluster's match");
-						}
-					}
-				}
-			   if(shouldmerge){
-				  //there is a point that these two clusters share -> they should be merged
-				  //rename all heads in cluster b to cluster a
-				  int clusterb=clusterindices2[indices[j]];
-				  for(uint m=0;m<clusterindices2.size();m++) if(clusterindices2[m]==clusterb) clusterindices2[m]=clusterindices2[i];
-				  break;
-			   } //if the point is shared
-			} //for every point close to both heads
-
-			time1+=g_tock(t1);
-		 } //if a head is close, and from a different cluster
-	  }//for every nearby head
-   }  //for every head
-   t1=g_tick();
-   recomputeClusters();
-   //erase the deleted clusters, and the ones under the minimum size
-   std::vector<int> deletedclusters;
-   std::vector< std::vector<int> > clusters2(clusters.size());
-   int numclusters=0;
-   for(int i=clusters.size()-1;i>=0; i--)
-	   if((int)clusters[i].size() >= min_pts_per_cluster){
-		clusters[i].swap(clusters2[numclusters++]);
-	   }
-   clusters.swap(clusters2);
-   clusters.resize(numclusters);
-//	  if((int)clusters[i].size() < min_pts_per_cluster){
-//		 clusters.erase(clusters.begin()+i);
-//		 deletedclusters.push_back(i);
-//   }
-   std::cout<<searchcount<<" searches took "<<time2<<"   "<<comparecount<<" compares for "<<mergecount<<" merges took "<<time1<<" rest took "<<g_tock(t1)<<endl;
-}
+   //the grids are sized by the first search on each: the grab radius for the cloud, the head reach for the heads
+   void setInputCloud(const typename pcl::PointCloud<PointT>::ConstPtr &cloud){ hash.setInputCloud(*cloud); }
+   void search(const PointT &pt, double radius, std::vector<int> &indices, std::vector<float> &dists){
+      hash.NNN(pt,indices,dists,radius);
+   }
+   void setHeads(const std::vector<int> &heads){ hash.useInds(heads); }
+   void searchHeads(const PointT &pt, double radius, std::vector<int> &indices, std::vector<float> &dists){
+      hash.NNN(pt,indices,dists,radius,true);
+   }
+};
 
+/** \brief @b KdIndex answers the engine's searches with a pair of KdTreeFLANN, one on the cloud and one on the heads.
+ * Neither copies the cloud.  If the caller already has a tree over the whole cloud, set prebuilt to it and the
+ * cloud's tree is not built again; it has to be over the same cloud, with no indices.
+ */
+template <typename PointT>
+struct KdIndex{
+   pcl::KdTreeFLANN<PointT> tree,headtree;
+   typename pcl::PointCloud<PointT>::ConstPtr cloudptr;
+   typename pcl::KdTree<PointT>::Ptr prebuilt;
+
+   void setInputCloud(const typename pcl::PointCloud<PointT>::ConstPtr &cloud){
+      cloudptr=cloud;
+      if(!prebuilt) tree.setInputCloud(cloudptr);
+   }
+   void search(const PointT &pt, double radius, std::vector<int> &indices, std::vector<float> &dists){
+      indices.clear();
+      dists.clear();
+      if(prebuilt) prebuilt->radiusSearch(pt,radius,indices,dists);
+      else tree.radiusSearch(pt,radius,indices,dists);
+   }
+   void setHeads(const std::vector<int> &heads){
+      headtree.setInputCloud(cloudptr,boost::make_shared<std::vector<int> >(heads));
+   }
+   void searchHeads(const PointT &pt, double radius, std::vector<int> &indices, std::vector<float> &dists){
+      indices.clear();
+      dists.clear();
+      headtree.radiusSearch(pt,radius,indices,dists);
+   }
+};
 
-//search through the heads and find heads that are between 1 and 3 * cluster_tol from a particular head
-void findMissedCandidates(){
-  tosearch.clear();
-   std::vector<vector<int> > miniclusters(heads.size());
-   for(uint i=0; i<clusterindices.size();i++)
-      miniclusters[clusterindices[i]].push_back(i);
-   int singles=0;
-   vector<int> indices,indices1;
-   tosearch.resize(clusterindices2.size());
-   double distthresh=_cluster_tol*_cluster_tol; //radius search gives squared distances...
-
-   for(uint i=0; i<clusterindices2.size();i++){ //for every head
-      if(clusterindices2[i]==-1) continue;   //skip the head if it is a loner
-      _sc2->NNN(_cloud->points[heads[i]],indices,2.0*_cluster_tol+farpt[i],true);     //search for nearby heads
-//      _sc2->NNN(_cloud->points[heads[i]],indices,3.0*_cluster_tol,true);     //search for nearby heads
-      for(uint j=0;j<indices.size();j++){ //for every head that is close to this head
-         if(clusterindices2[indices[j]]==-1) continue;  //skip the head if it is a loner
-         if(clusterindices2[indices[j]] == clusterindices2[i] || indices[j] < (int)i)//if the two heads are not in the same cluster (and only check each combo once)
-            continue;
-//         if(miniclusters[i].size()==1 ) continue;
-//         if(miniclusters[indices[j]].size()==1 ) continue;
-//         if(pcl::squaredEuclideanDistance(_cloud->points[heads[indices[j]]],_cloud->points[heads[i]]) < distthresh) singles++;
-//         if(initialgrabs[indices[j]]==2) singles++;
-//         if(pcl::squaredEuclideanDistance(_cloud->points[heads[indices[j]]],_cloud->points[heads[i]]) < 4.0* distthresh) continue;
-         //now indices[j] is a nearby head that is from a different cluster
-         tosearch[i].push_back(indices[j]);
-         singles+=indices.size()-indices1.size();
-      }//for every head that is close to this head
-   }//for every head
-
-   cout<<singles<<" singles."<<endl;
-}
+/** \brief @b GrabSeeds walks the cloud, and makes each point nobody has grabbed yet a head, which grabs every point
+ * within cluster_tol/ratio of it.  Later heads take points over from earlier ones.  This is the downsampling
+ * extractEuclideanClustersFast2 has always done (ratio 2.1), and segfastt before it (ratio 2.3).
+ */
+struct GrabSeeds{
+   double ratio;
+   GrabSeeds(double _ratio=2.1){ ratio=_ratio; }
+
+   double grabRadius(double cluster_tol) const { return cluster_tol/ratio; }
+
+   template <typename Engine, typename PointT>
+   void seed(Engine &e, const pcl::PointCloud<PointT> &cloud, double cluster_tol){
+      double radius=grabRadius(cluster_tol);
+      for(uint i=0;i<cloud.points.size();++i){
+         if(e.owner[i]!=-1) continue;
+         e.index.search(cloud.points[i],radius,e.inds,e.dists);
+         e.stats.searchcount++;
+         if(!e.inds.size()) continue;   //only a point with bad coordinates finds nothing, not even itself
+         int h=e.addHead(i,e.dists);
+         for(uint j=0;j<e.inds.size();++j)
+            e.owner[e.inds[j]]=h;
+      }
+      e.sets.reset(e.heads.size());
+   }
+};
 
-//evaluate whether the findMissedCandidates is finding everything correctly
-void checktoSearch(std::vector<int> &labels,int numclusters){
-	std::vector< std::vector<int> > headclusters(numclusters);
-	std::vector< std::vector<int> > reclusters(numclusters);
-	std::vector< std::vector<int> > reclustercheck(numclusters);
-	for(uint i=0; i<heads.size();++i){
-		headclusters[labels[heads[i]]].push_back(i);
-		if(!count(reclusters[labels[heads[i]]].begin(),reclusters[labels[heads[i]]].end(), clusterindices2[i]))
-			reclusters[labels[heads[i]]].push_back(clusterindices2[i]);
-	}
-//	headclusters maps from cluster number to heads in that cluster
-//	reclusters maps from cluster number to current cluster #s in that cluster
+/** \brief @b ClaimSeeds is the head picking segfast uses: heads grab everything within cluster_tol, and
+ * any two heads that grab the same point are joined right away, since that point links them.  This gives far
+ * fewer heads than GrabSeeds, and most of the joining is done by the time the heads are picked.
+ */
+struct ClaimSeeds{
+   std::vector<int> shared;   //pairs of heads that grabbed the same point
+
+   double grabRadius(double cluster_tol) const { return cluster_tol; }
+
+   template <typename Engine, typename PointT>
+   void seed(Engine &e, const pcl::PointCloud<PointT> &cloud, double cluster_tol){
+      shared.clear();
+      for(uint i=0;i<cloud.points.size();++i){
+         if(e.owner[i]!=-1) continue;
+         e.index.search(cloud.points[i],cluster_tol,e.inds,e.dists);
+         e.stats.searchcount++;
+         if(!e.inds.size()) continue;
+         int h=e.addHead(i,e.dists);
+         for(uint j=0;j<e.inds.size();++j){
+            int &o=e.owner[e.inds[j]];
+            if(o!=-1 && o!=h){
+               shared.push_back(o);
+               shared.push_back(h);
+            }
+            o=h;
+         }
+      }
+      e.sets.reset(e.heads.size());
+      for(uint k=0;k<shared.size();k+=2)
+         e.sets.join(shared[k],shared[k+1]);
+   }
+};
 
-	//now to check tosearch:
-	//for each end cluster:
-	for(uint endcluster=0; endcluster<reclusters.size();++endcluster){
+/** \brief @b MidpointMerge is the gap check extractEuclideanClustersFast2 and segfast used to do: search around the
+ * point halfway between the two heads, and join any two clusters that have points found there within cluster_tol
+ * of each other.  Quick, but it can miss a close pair that sits away from the midpoint.
+ */
+struct MidpointMerge{
+   std::vector<int> inds,roots,start,fill,order;
+   std::vector<float> dists;
+   PointsSoA pts;
+
+   template <typename Engine, typename PointT>
+   bool check(Engine &e, const pcl::PointCloud<PointT> &cloud, double cluster_tol, int ha, int hb){
+      const PointT &a=cloud.points[e.heads[ha]], &b=cloud.points[e.heads[hb]];
+      PointT inbetween;
+      inbetween.x=(a.x+b.x)/2.0;
+      inbetween.y=(a.y+b.y)/2.0;
+      inbetween.z=(a.z+b.z)/2.0;
+      e.index.search(inbetween,cluster_tol,inds,dists);
+      e.stats.searchcount++;
+      if(inds.size()<2) return false;
+      //group the points found by cluster, and lay them out cluster by cluster
+      roots.clear();
+      order.resize(inds.size());
+      for(uint k=0;k<inds.size();++k){
+         int root=e.sets.find(e.owner[inds[k]]);
+         uint c=0;
+         while(c<roots.size() && roots[c]!=root) c++;
+         if(c==roots.size()) roots.push_back(root);
+         order[k]=c;
+      }
+      if(roots.size()<2) return false;
+      start.assign(roots.size()+1,0);
+      for(uint k=0;k<inds.size();++k) start[order[k]+1]++;
+      for(uint c=0;c<roots.size();++c) start[c+1]+=start[c];
+      fill.assign(start.begin(),start.end()-1);
+      pts.x.resize(inds.size()); pts.y.resize(inds.size()); pts.z.resize(inds.size());
+      for(uint k=0;k<inds.size();++k){
+         int slot=fill[order[k]]++;
+         const PointT &p=cloud.points[inds[k]];
+         pts.x[slot]=p.x; pts.y[slot]=p.y; pts.z[slot]=p.z;
+      }
+      double distthresh=cluster_tol*cluster_tol;
+      for(uint i=0;i+1<roots.size();++i)
+         for(uint j=i+1;j<roots.size();++j){
+            if(e.sets.find(roots[i])==e.sets.find(roots[j])) continue;
+            e.stats.comparecount++;
+            if(anyPairWithin(pts,start[i],start[i+1]-start[i],pts,start[j],start[j+1]-start[j],distthresh))
+               if(e.sets.join(roots[i],roots[j])) e.stats.mergecount++;
+         }
+      return e.sets.find(ha)==e.sets.find(hb);
+   }
+};
 
+/** \brief @b ExactMerge settles each pair of heads by comparing the points they grabbed, with a BorderCheck.
+ * Unlike MidpointMerge it never misses, so the clustering comes out exactly as the Euclidean definition says.
+ */
+struct ExactMerge{
+   BorderCheck border;
+
+   template <typename Engine, typename PointT>
+   bool check(Engine &e, const pcl::PointCloud<PointT> &cloud, double cluster_tol, int ha, int hb){
+      e.stats.comparecount++;
+      const HeadGraph &m=e.members;
+      if(!border.touches(cloud,&m.edges[m.begin(ha)],m.end(ha)-m.begin(ha),cloud.points[e.heads[ha]],e.reach[ha],
+            &m.edges[m.begin(hb)],m.end(hb)-m.begin(hb),cloud.points[e.heads[hb]],e.reach[hb],cluster_tol))
+         return false;
+      if(e.sets.join(ha,hb)) e.stats.mergecount++;
+      return true;
+   }
+};
 
-	}
+/** \brief @b ClusterVectorSink writes the clusters as a vector of vector of ints, and hands out the ClusterStats of
+ * each if asked.  The engine fills those in while it packs the clusters.
+ */
+struct ClusterVectorSink{
+   std::vector<std::vector<int> > &clusters;
+   std::vector<ClusterStats> *clusterstats;
+   ClusterLabels scratch;
 
+   ClusterVectorSink(std::vector<std::vector<int> > &_clusters, std::vector<ClusterStats> *_clusterstats=NULL)
+      :clusters(_clusters),clusterstats(_clusterstats){}
 
-}
+   ClusterLabels &labels(){ return scratch; }
+   std::vector<ClusterStats> *clusterStats(){ return clusterstats; }
 
+   template <typename PointT>
+   void write(const pcl::PointCloud<PointT> &cloud, const ClusterLabels &l){
+      l.toClusters(clusters);
+   }
+};
 
+/** \brief @b ClusterLabelsSink leaves the clustering in the caller's ClusterLabels. */
+struct ClusterLabelsSink{
+   ClusterLabels &out;
+   ClusterLabelsSink(ClusterLabels &_out):out(_out){}
+   ClusterLabels &labels(){ return out; }
+   std::vector<ClusterStats> *clusterStats(){ return NULL; }
+   template <typename PointT>
+   void write(const pcl::PointCloud<PointT> &cloud, const ClusterLabels &l){}
+};
 
-//c1 and c2 are heads with different clusters that should be merged
-//assume c1<c2
-void merge(int c1, int c2){
-   //merge the higher index into the lower index
-   int cl2=clusterindices2[c2];
-   for(uint i=0; i<clusters[cl2].size();++i){
-      clusterindices2[clusters[cl2][i]] = clusterindices2[c1]; //remap the cluster that each head in c2's cluster points to
-   }
-   clusters[clusterindices2[c1]].insert(clusters[clusterindices2[c1]].end(), clusters[cl2].begin(),clusters[cl2].end()); //move all the heads from cluster 2 to cluster 1
-   //now check that no head in the merged cluster wants to search against a head in its own cluster:
-   for(uint i=0; i<tosearch.size();++i){
-      for(uint j=0;j<tosearch[i].size();++j){
-         if(clusterindices2[tosearch[i][j]] == clusterindices2[i] )
-            tosearch[i].erase(tosearch[i].begin() + j);
+/** \brief @b ClusterCloudSink copies each cluster out into a cloud of its own. */
+template <typename PointT>
+struct ClusterCloudSink{
+   std::vector<pcl::PointCloud<PointT> > &clouds;
+   ClusterLabels scratch;
+
+   ClusterCloudSink(std::vector<pcl::PointCloud<PointT> > &_clouds):clouds(_clouds){}
+
+   ClusterLabels &labels(){ return scratch; }
+   std::vector<ClusterStats> *clusterStats(){ return NULL; }
+
+   void write(const pcl::PointCloud<PointT> &cloud, const ClusterLabels &l){
+      clouds.resize(l.size());
+      for(int c=0;c<l.size();++c){
+         clouds[c].header=cloud.header;
+         clouds[c].points.resize(l.clusterSize(c));
+         for(int e=l.begin(c);e<l.end(c);++e)
+            clouds[c].points[e-l.begin(c)]=cloud.points[l.indices[e]];
+         clouds[c].width=clouds[c].points.size();
+         clouds[c].height=1;
+         clouds[c].is_dense=true;
       }
    }
-}
+};
 
-bool isMatch(std::vector<int> &pts1, std::vector<int> &pts2, double &distthresh){
-   for(uint k=0; k<pts1.size();++k){
-      for(uint m=0; m<pts2.size();++m){
-         if(pcl::squaredEuclideanDistance(_cloud->points[pts1[k]],_cloud->points[pts2[m]] ) <= distthresh)
-            return true;
-      }
+/** \brief @b EuclideanClusterEngine is the head based Euclidean clustering, put together from an index policy, a seed
+ * policy and a merge policy (see above).  Keep one around to reuse its memory between clouds.  Points with
+ * non-finite coordinates are not put in any cluster.
+ */
+template <typename PointT, typename IndexPolicy=HashIndex<PointT>, typename SeedPolicy=GrabSeeds, typename MergePolicy=ExactMerge>
+class EuclideanClusterEngine{
+public:
+   IndexPolicy index;
+   SeedPolicy seeder;
+   MergePolicy merger;
+   int verbosity; //0: quiet, 1: print the stats after each call
+
+   //the state the policies work on
+   std::vector<int> heads;     //the cloud index of each head
+   std::vector<int> owner;     //the head that grabbed each point, -1 for none
+   std::vector<float> reach;   //how far each head grabbed: the distance to the furthest point it took
+   std::vector<char> alone;    //1 if nothing else was within cluster_tol of the head when it grabbed
+   HeadGraph members;          //the points each head ended up with
+   DisjointSets sets;          //which heads have been joined
+   std::vector<int> candidates; //pairs of heads too far apart to join outright, but close enough to need the gap check
+   std::vector<int> inds,hinds,rootlabel;
+   std::vector<float> dists,hdists;
+   double tol,grabradius;      //of the cloud being clustered
+   SegfastStats stats;
+
+   EuclideanClusterEngine(int _verbosity=0){ verbosity=_verbosity; tol=grabradius=0; }
+   EuclideanClusterEngine(const SeedPolicy &_seeder, int _verbosity=0):seeder(_seeder){ verbosity=_verbosity; tol=grabradius=0; }
+
+   //for seed policies: make cloud point i a head, given the squared distances to the points it grabbed
+   int addHead(int i, const std::vector<float> &grabdists){
+      float maxdist=0;
+      for(uint j=0;j<grabdists.size();++j)
+         if(grabdists[j]>maxdist) maxdist=grabdists[j];
+      heads.push_back(i);
+      reach.push_back(sqrt(maxdist));
+      alone.push_back(grabdists.size()<=1 && grabradius>=tol);
+      return heads.size()-1;
    }
-   return false;
-}
 
+   /** \brief cluster the cloud, and hand the result to sink.  returns the number of clusters */
+   template <typename Sink>
+   int cluster(const pcl::PointCloud<PointT> &cloud, Sink &sink, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits()){
+      return cluster(typename pcl::PointCloud<PointT>::ConstPtr(&cloud,NullDeleter()),sink,cluster_tol,limits);
+   }
 
-//given a set of indices within cluster_tol of a point, find the points that are of different clusters, and < cluster_tol from each other
-bool findMatches(std::vector<int> &pts, std::vector<int> &clusts, std::vector<int> &clustremap){
-   double distthresh=_cluster_tol*_cluster_tol; //radius search gives squared distances...
-   clusts.clear();
-   std::vector< std::vector<int> > clustpts;
-   for(uint i=0; i<pts.size();++i){
-      bool found=false;
-      for(uint j=0;j<clusts.size();++j){
-         if(clusts[j]==clusterindices2[clusterindices[pts[i]]]){
-            clustpts[j].push_back(pts[i]);
-            found=true;
-            break;
-         }
-      }
-      if(!found){
-         clusts.push_back(clusterindices2[clusterindices[pts[i]]]);
-         clustpts.push_back(std::vector<int>(1,pts[i]));
-      }
+   /** \brief the same, for a cloud that is already held by a shared pointer */
+   template <typename Sink>
+   int cluster(const typename pcl::PointCloud<PointT>::ConstPtr &cloudptr, Sink &sink, double cluster_tol=.2,
+         const ClusterLimits &limits=ClusterLimits()){
+      timeval ttot=g_tick();
+      pickHeads(cloudptr,cluster_tol);
+      joinHeads(*cloudptr,limits);
+      ClusterLabels &labels=sink.labels();
+      stats.numclusters=labels.finish(labelPoints(labels.labels),limits,cloudptr.get(),sink.clusterStats());
+      sink.write(*cloudptr,labels);
+      stats.totaltime=g_tock(ttot);
+      if(verbosity>0) stats.print();
+      return stats.numclusters;
    }
-   bool ret=false;
-   //now all the points are organized in clusters
-   //so compare the clusters to each other by pts:
-   clustremap=clusts;
-   for(uint i=0; i<clusts.size()-1;++i)
-      for(uint j=i+1;j<clusts.size();++j){
-         if(clustremap[j]==clustremap[i]) continue; //we've already matched these clusters!
-         if(isMatch(clustpts[i],clustpts[j],distthresh)){
-            clustremap[j]=clustremap[i];
-
-            ret=true;
-         }
-      }
-   return ret;
-}
 
-//merge a set of clusters, indicated by the remapping
-int merge( std::vector<int> &clusts, std::vector<int> &clustremap){
-
-   int removedsearches=0;
-   int numclusters=0;
-   for(uint c1=0; c1<clusts.size();++c1){
-      if(clustremap[c1]==clusts[c1]) continue;
-      numclusters++;
-      //merge the higher index into the lower index
-      int cl2=clusts[c1], cl1=clustremap[c1];
-      for(uint i=0; i<clusters[cl2].size();++i){
-         clusterindices2[clusters[cl2][i]] = cl1; //remap the cluster that each head in c2's cluster points to
-      }
-      clusters[cl1].insert(clusters[cl1].end(), clusters[cl2].begin(),clusters[cl2].end()); //move all the heads from cluster 2 to cluster 1
-      clusters[cl2].clear();
+   //the phases of cluster(), for clusterings that need to step in between them.  Run them in order.
+
+   /** \brief pick the heads with the seed policy, and list the points each one ended up with. this starts the stats over */
+   void pickHeads(const typename pcl::PointCloud<PointT>::ConstPtr &cloudptr, double cluster_tol){
+      const pcl::PointCloud<PointT> &cloud=*cloudptr;
+      stats.clear();
+      timeval t0=g_tick();
+      int n=cloud.points.size();
+      stats.numpoints=n;
+      tol=cluster_tol;
+      grabradius=seeder.grabRadius(cluster_tol);
+      index.setInputCloud(cloudptr);
+      heads.clear();
+      reach.clear();
+      alone.clear();
+      owner.assign(n,-1);
+      seeder.seed(*this,cloud,cluster_tol);
+      stats.numheads=heads.size();
+      members.offsets.assign(heads.size()+1,0);
+      for(int i=0;i<n;++i)
+         if(owner[i]!=-1) members.offsets[owner[i]+1]++;
+      for(uint h=0;h<heads.size();++h)
+         members.offsets[h+1]+=members.offsets[h];
+      members.edges.resize(members.offsets.back());
+      rootlabel.assign(members.offsets.begin(),members.offsets.end()-1);
+      for(int i=0;i<n;++i)
+         if(owner[i]!=-1) members.edges[rootlabel[owner[i]]++]=i;
+      stats.downsampletime=g_tock(t0);
    }
 
-   for(uint c1=0; c1<clustremap.size();++c1){
-      if(clustremap[c1]==clusts[c1] || clustremap[c1]==-1) continue;
-      int cl1=clustremap[c1];
-      for(uint i=0; i<clustremap.size();++i) if(clustremap[i]==cl1) clustremap[i]=-1; //remove this cluster from the remapping
-      //now check that no head in the merged cluster wants to search against a head in its own cluster:
-      //TODO: why does this not work to just search in the new cluster?
-      for(uint i=0; i<clusters[cl1].size();++i){ //for all the points in the new cluster
-         for(int j=tosearch[i].size()-1; j>=0;--j){ //for all the heads that that pt wants to search
-            if(clusterindices2[tosearch[i][j]] == clusterindices2[i] ){
-               tosearch[i].erase(tosearch[i].begin() + j);
-               removedsearches++;
+   /** \brief join the heads within cluster_tol of each other, and settle the pairs that are close enough to touch
+     * with the merge policy.  Pairs of clusters that are both over limits.maxsize are left alone.
+     */
+   void joinHeads(const pcl::PointCloud<PointT> &cloud, const ClusterLimits &limits=ClusterLimits()){
+      //a point grabbed by head a and one grabbed by head b can only be within cluster_tol if the heads are
+      //within cluster_tol+reach[a]+reach[b].  heads within cluster_tol are joined outright, the rest get checked.
+      //a head that was alone has nothing within cluster_tol, so it can be left out altogether
+      timeval t0=g_tick();
+      index.setHeads(heads);
+      float maxreach=0;
+      for(uint h=0;h<heads.size();++h)
+         if(!alone[h] && reach[h]>maxreach) maxreach=reach[h];
+      float jointhresh=pairdist::leThresh(tol*tol);
+      candidates.clear();
+      for(uint h=0;h<heads.size();++h){
+         if(alone[h]){
+            stats.numloners++;
+            continue;
+         }
+         index.searchHeads(cloud.points[heads[h]],tol+reach[h]+maxreach,hinds,hdists);
+         stats.searchcount++;
+         for(uint k=0;k<hinds.size();++k){
+            int h2=hinds[k];
+            if(h2<=(int)h || alone[h2]) continue;   //each pair once
+            if(hdists[k]<=jointhresh) sets.join(h,h2);
+            else if(sqrt(hdists[k]) <= tol+reach[h]+reach[h2]+1e-6){
+               candidates.push_back(h);
+               candidates.push_back(h2);
             }
          }
       }
+      stats.pairingtime=g_tock(t0);
+
+      t0=g_tick();
+      if(limits.bounded()) sets.weigh(members.offsets);
+      for(uint k=0;k<candidates.size();k+=2){
+         int ra=sets.find(candidates[k]),rb=sets.find(candidates[k+1]);
+         if(ra==rb || limits.bothTooBig(sets,ra,rb)) continue;
+         merger.check(*this,cloud,tol,candidates[k],candidates[k+1]);
+      }
+      stats.mergetime=g_tock(t0);
    }
-//   cout<<"   nc: "<<numclusters<<"    rs: "<<removedsearches<<endl;
-   return removedsearches;
-}
 
-void checkClustering3(int min_pts_per_cluster=1){
-// recomputeClusters();
-   //now we need to check to see if any of the heads that were NOT clustered together are closer than cluster_tol+smaller_tol.
-   //This covers the exception noted in the code block above
-   //this is where an adversary could really kill this algorithm, since this check could be polynomial in cloud size. in real circumstances, it is very quick.
-   vector<int> indices1;
-   vector<int> indices;
-   int searchcount=0,comparecount=0,mergecount=0;
-   double distthresh=_cluster_tol*_cluster_tol; //radius search gives squared distances...
-
-//   double automergethresh=_cluster_tol*_cluster_tol/4.0; //pts are always in same cluster if they are both less than half the tolerance away from the same point
-   timeval t1,t0=g_tick();
-   double time1=0,time2=0;
-
-   findMissedCandidates(); //generates a tosearch variable, which indicates pairs of heads to compare
-   cout<<" find candidates took "<<g_tock(t0)<<endl;
-
-   vector<int> clusts, clustremap;
-   for(uint i=0; i<tosearch.size();++i){
-      while(tosearch[i].size()){
-         int pt2=tosearch[i].back();
-         PointT heada=_cloud->points[heads[i]], headb=_cloud->points[heads[tosearch[i].back()]];
-         tosearch[i].pop_back(); //not going to do this search again
-
-         PointT inbetween;
-         inbetween.x=(heada.x+headb.x)/2.0;
-         inbetween.y=(heada.y+headb.y)/2.0;
-         inbetween.z=(heada.z+headb.z)/2.0;
-         searchcount++;
-         t1=g_tick();
-          _sc2->NNN(inbetween,indices1,_cluster_tol); //search on the full tree
-         time2+=g_tock(t1);
-         t1=g_tick();
-         if(indices1.size()<2) continue;
-         if(findMatches(indices1,clusts,clustremap)){//a merging was found!
-//            bool correctmatch=false;
-//            for(uint k=0;k<clusts.size(); k++)
-//               if(clusts[k]!=clustremap[k] && (clusts[k]==clusterindices2[pt2] || clusts[k]==clusterindices2[i]))
-//                  correctmatch=true;
-//            if(correctmatch && pcl::squaredEuclideanDistance(_cloud->points[heads[i]],_cloud->points[heads[pt2]]) < 4.0* distthresh)
-//               cout<<heads[i]<<" and "<<heads[pt2]<<" were "<<pcl::euclideanDistance(_cloud->points[heads[i]],_cloud->points[heads[pt2]])<<" apart"<<endl;
-            comparecount+=merge(clusts,clustremap);   //this may remove a bunch of tosearch subindices, but since we are in a while loop, we just keep going...
-            mergecount++;
+   /** \brief label the points with the cluster of their head, numbered in order of first appearance, ready for
+     * ClusterLabels::finish.  If order is given, the cloud is a reordered copy, and the label of its point i goes to
+     * labels[order[i]].  returns the number of labels
+     */
+   int labelPoints(std::vector<int> &labels, const std::vector<int> *order=NULL){
+      int n=owner.size();
+      labels.resize(n);
+      rootlabel.assign(heads.size(),-1);
+      int numlabels=0;
+      for(int i=0;i<n;++i){
+         int &l=labels[order ? (*order)[i] : i];
+         if(owner[i]==-1){
+            l=-1;
+            continue;
          }
-         time1+=g_tock(t1);
+         int root=sets.find(owner[i]);
+         if(rootlabel[root]==-1) rootlabel[root]=numlabels++;
+         l=rootlabel[root];
       }
+      return numlabels;
    }
-   t1= g_tick();
-   std::vector< std::vector<int> > clusters2(clusters.size());
-   int numclusters=0;
-   for(int i=clusters.size()-1;i>=0; i--)
-      if((int)clusters[i].size() >= min_pts_per_cluster){
-      clusters[i].swap(clusters2[numclusters++]);
-      }
-   clusters.swap(clusters2);
-   clusters.resize(numclusters);
-   int numheads=0;
-   for(int i=clusters.size()-1;i>=0; i--)
-      numheads+=clusters[i].size();
-   cout<<"clusters contain "<<numheads<<" heads"<<endl;
-
-   std::cout<<searchcount<<" searches took "<<time2<<"   "<<comparecount<<" compares for "<<mergecount<<" merges took "<<time1<<" rest took "<<g_tock(t1)<<endl;
-}
+};
+
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b SegfastWorkspace holds all the scratch memory segfast needs: the clustering engine and its spatial index,
+  * and the Morton sorted copy of the cloud.  Keep one around and hand it to segfast every frame; once it has grown
+  * to the size of the clouds it sees, clustering a new frame reuses its buffers instead of allocating new ones.
+  */
+template <typename PointT>
+struct SegfastWorkspace{
+	//segfast's clustering: heads claim everything within cluster_tol, and the gaps between them are checked exactly
+	typedef EuclideanClusterEngine<PointT,HashIndex<PointT>,ClaimSeeds,ExactMerge> Engine;
+	Engine engine;
+	int verbosity; //0: quiet, 1: print the stats after each call
+	bool mortonorder;  //if true, segfast clusters a copy of the cloud sorted into Morton order, for better cache use on big clouds
+	pcl::PointCloud<PointT> sorted;   //that copy
+	std::vector<int> order;           //sorted.points[k] is cloud.points[order[k]]. empty if the cloud was not sorted
+	std::vector<std::pair<unsigned long long,int> > mortonkeys;
+	ClusterLabels flat;               //the clustering, before it is unpacked into a vector of vector of ints
+
+	SegfastWorkspace(int _verbosity=0){ verbosity=_verbosity; mortonorder=false; }
+};
 
 
-void checkClustering2(int min_pts_per_cluster=1){
-//	recomputeClusters();
-   //now we need to check to see if any of the heads that were NOT clustered together are closer than cluster_tol+smaller_tol.
-   //This covers the exception noted in the code block above
-   //this is where an adversary could really kill this algorithm, since this check could be polynomial in cloud size. in real circumstances, it is very quick.
-   vector<int> indices1;
-   vector<int> indices;
-   int searchcount=0,comparecount=0,mergecount=0;
-   double distthresh=_cluster_tol*_cluster_tol; //radius search gives squared distances...
-
-//   double automergethresh=_cluster_tol*_cluster_tol/4.0; //pts are always in same cluster if they are both less than half the tolerance away from the same point
-   timeval t1,t0=g_tick();
-   double time1,time2;
-//   bool verbose=false;
-   for(uint i=0; i<clusterindices2.size();i++){ //for every head
-	   if(clusterindices2[i]==-1) continue;	//skip the head if it is a loner
-      _sc2->NNN(_cloud->points[heads[i]],indices,3.0*_cluster_tol,true);
-	  for(uint j=0;j<indices.size();j++){ //for every head that is close to this head
-		 if(clusterindices2[indices[j]]==-1) continue;	//skip the head if it is a loner
-		 if(clusterindices2[indices[j]] != clusterindices2[i] && indices[j] > i){//if the two heads are not in the same cluster (and only check each combo once)
-			 //if the heads are within 2*cluster_tol, they are not related, or they would already be clustered.
-			 if(pcl::squaredEuclideanDistance(_cloud->points[heads[indices[j]]],_cloud->points[heads[i]]) < 4.0* distthresh)
-				 continue;
-			//now we have to find if there is a point between head a and head b that is < cluster_tol from both
-			//our best chance of finding it is to start searching at a point halfway between them
-			PointT heada=_cloud->points[heads[i]], headb=_cloud->points[heads[indices[j]]];
-			PointT inbetween;
-			inbetween.x=(heada.x+headb.x)/2.0;
-			inbetween.y=(heada.y+headb.y)/2.0;
-			inbetween.z=(heada.z+headb.z)/2.0;
-			searchcount++;
-			t1=g_tick();
-		    _sc2->NNN(inbetween,indices1,_cluster_tol); //search on the full tree
-			time2+=g_tock(t1);
-		    if(!indices1.size())
-		    	continue;
-			//must match all points that return against each other
-			bool shouldmerge=false;
-			int mergefrom,mergeinto;
-			t1=g_tick();
-			for(int k=0;k<((int)indices1.size())-1;k++){
-				for(uint m=k+1;m<indices1.size();m++){
-					if(clusterindices2[clusterindices[indices1[k]]] != clusterindices2[clusterindices[indices1[m]]]  && (clusterindices2[clusterindices[indices1[k]]] == clusterindices2[i] || clusterindices2[clusterindices[indices1[m]]] ==clusterindices2[i] )){ //if different clusters
-						comparecount++;
-						if((pcl::squaredEuclideanDistance(_cloud->points[indices1[k]],_cloud->points[indices1[m]] ) < distthresh)){
-						   mergefrom=clusterindices2[clusterindices[indices1[k]]];
-						   mergeinto=clusterindices2[clusterindices[indices1[m]]];
-						   if(!((mergefrom !=clusterindices2[i] && mergefrom !=clusterindices2[indices[j]]) || (mergeinto !=clusterindices2[i] && mergeinto !=clusterindices2[indices[j]]))){
-							   shouldmerge=true;
-								mergecount++;
-							   break;  //TODO: shouldn't actually break, but rather see if multiple clusters should merge
-						   }
-//						   else
-//							   ROS_ERROR("Found connection between  %d and %d  while inspecting %d and %d ",mergefrom, mergeinto,clusterindices2[i],clusterindices2[indices[j]] );
-						}
-					}
-				}
-			   if(shouldmerge){
-				  //there is a point that these two clusters share -> they should be merged
-				  //rename all heads in cluster b to cluster a
-				  int clusterb=clusterindices2[indices[j]];
-				  for(uint m=0;m<clusterindices2.size();m++) if(clusterindices2[m]==clusterb) clusterindices2[m]=clusterindices2[i];
-				  break;
-			   } //if the point is shared
-			} //for every point close to both heads
-
-			time1+=g_tock(t1);
-		 } //if a head is close, and from a different cluster
-	  }//for every nearby head
-   }  //for every head
-   t1=g_tick();
-//   recomputeClusters();
-   //erase the deleted clusters, and the ones under the minimum size
-   std::vector<int> deletedclusters;
-   std::vector< std::vector<int> > clusters2(clusters.size());
-   int numclusters=0;
-   for(int i=clusters.size()-1;i>=0; i--)
-	   if((int)clusters[i].size() >= min_pts_per_cluster){
-		clusters[i].swap(clusters2[numclusters++]);
-	   }
-   clusters.swap(clusters2);
-   clusters.resize(numclusters);
-//	  if((int)clusters[i].size() < min_pts_per_cluster){
-//		 clusters.erase(clusters.begin()+i);
-//		 deletedclusters.push_back(i);
-//   }
-   std::cout<<searchcount<<" searches took "<<time2<<"   "<<comparecount<<" compares for "<<mergecount<<" merges took "<<time1<<" rest took "<<g_tock(t1)<<endl;
+/** \brief Cluster the cloud into labels: a label per point and the clusters in compressed rows.
+  * Between the workspace and labels, nothing is allocated once they have seen a cloud this big.
+  * Clusters outside the limits are dropped, and their points labeled -1.
+  */
+template <typename PointT>
+void segfast(pcl::PointCloud<PointT> &cloud, ClusterLabels &labels, SegfastWorkspace<PointT> &workspace,
+		double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(), SegfastStats *stats=NULL){
+	typename SegfastWorkspace<PointT>::Engine &engine=workspace.engine;
+	SegfastStats &st=engine.stats;
+	timeval ttot=g_tick();
+	workspace.order.clear();
+	if(!workspace.mortonorder){
+		ClusterLabelsSink sink(labels);
+		engine.cluster(cloud,sink,cluster_tol,limits);
+	}
+	else{
+		//cluster the sorted copy, and write its labels straight back into the caller's order
+		timeval t0=g_tick();
+		mortonOrder(cloud,cluster_tol,workspace.order,workspace.mortonkeys);
+		reorderCloud(cloud,workspace.order,workspace.sorted);
+		double reordertime=g_tock(t0);
+		engine.pickHeads(typename pcl::PointCloud<PointT>::ConstPtr(&workspace.sorted,NullDeleter()),cluster_tol);
+		engine.joinHeads(workspace.sorted,limits);
+		st.numclusters=labels.finish(engine.labelPoints(labels.labels,&workspace.order),limits);
+		st.reordertime=reordertime;
+	}
+	st.totaltime=g_tock(ttot);
+	if(workspace.verbosity>0) st.print();
+	if(stats) *stats=st;
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief Decompose a Point Cloud into clusters based on the Euclidean distance between points. Uses Hierarchical Clustering, making it faster
+  * \param cloud the point cloud message
+  * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
+  * \param cclusters the resultant clusters containing point indices (as a vector of vector of ints)
+  * \param workspace scratch memory, kept between calls so that clustering a stream of clouds does not keep allocating
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param stats if given, filled out with the timings and counts for this call
+  * Only the clusters that are kept get a list of points: the rest are dropped while they are still labels.
+  */
+template <typename PointT>
+void segfast(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, SegfastWorkspace<PointT> &workspace,
+		double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(), SegfastStats *stats=NULL){
+	segfast(cloud,workspace.flat,workspace,cluster_tol,limits,stats);
+	workspace.flat.toClusters(clusters);
+}
 
+//the same, with a workspace that only lives for this call
+template <typename PointT>
+void segfast(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2,
+		const ClusterLimits &limits=ClusterLimits(), SegfastStats *stats=NULL){
+	SegfastWorkspace<PointT> workspace;
+	segfast(cloud,clusters,workspace,cluster_tol,limits,stats);
+}
 
-//   template <typename PointT>
-//   bool checkcluster( pcl::PointCloud<PointT> &cloud,std::vector<int>  &inds, double tol,int pt){
-//         for(uint i=0;i<inds.size();i++)
-//            if(pcl::euclideanDistance(cloud.points[pt],cloud.points[inds[i]]) > tol){
-//               ROS_ERROR("Point index %d is %f from point %d ",i,pcl::euclideanDistance(cloud.points[pt],cloud.points[inds[i]]),pt);
-//               return false;
-//            }
-//         return true;
-//   }
-//
-//   //performs nearest neighbor search in a simplistic fashion
-//   template <typename PointT>
-//   void bigNN(pcl::PointCloud<PointT> &cloud, PointT pt, std::vector<int> &inds, double radius){
-//      inds.clear();
-//      double r2=radius*radius;
-//      double smallerrad=radius/sqrt(3);
-//      double diffx,diffy,diffz;
-//      for(uint i=0;i<cloud.points.size(); i++){
-//         diffx=fabs(cloud.points[i].x - pt.x);
-//         diffy=fabs(cloud.points[i].y - pt.y);
-//         diffz=fabs(cloud.points[i].z - pt.z);
-//         if(diffx < radius && diffy < radius && diffz < radius){ //in outer box
-//            if(diffx < smallerrad && diffy < smallerrad && diffz < smallerrad) //also in inner box - include!
-//               inds.push_back(i);
-//            else//between the boxes: check for actual distance
-//               if(diffx*diffx+diffy*diffy+diffz*diffz < r2)
-//                  inds.push_back(i);
-//         }
-//      }
-//   }
-//
-//   //performs nearest neighbor search in a simplistic fashion
-//   //this version assumes inds is the size of cloud, and just marks the points
-//   template <typename PointT>
-//   void bigNN(pcl::PointCloud<PointT> &cloud, PointT &pt, std::vector<int> &inds, double radius, int mark){
-//      double r2=radius*radius;
-//      double smallerrad=radius/sqrt(3);
-//      double diffx,diffy,diffz;
-//      for(uint i=0;i<cloud.points.size(); i++){
-//         diffx=fabs(cloud.points[i].x - pt.x);
-//         diffy=fabs(cloud.points[i].y - pt.y);
-//         diffz=fabs(cloud.points[i].z - pt.z);
-//         if(diffx < radius && diffy < radius && diffz < radius){ //in outer box
-////            if(diffx < smallerrad && diffy < smallerrad && diffz < smallerrad) //also in inner box - include!
-////               inds[i]=mark;
-////            else//between the boxes: check for actual distance
-//               if(diffx*diffx+diffy*diffy+diffz*diffz < r2)
-//                  inds[i]=mark;
-//         }
-//      }
-//   }
-//
-//   //simply runs radius search to grab all the points nearby until everything is taken
-//   //results in each pt assigned a label, and a list of who grabbed each point
-//   //this version uses the bigNN function
-//   template <typename PointT>
-//   void bigDownsample(pcl::PointCloud<PointT> &cloud, double cluster_tol=.2){
-//      timeval t0=g_tick();
-//      clusterindices.resize(cloud.size(),-1);
-//      std::cout<<"resizing took "<<g_tock(t0)<<endl; t0=g_tick();
-//      int searchcount=0;
-//      for(uint i=0; i<clusterindices.size();i++){
-//       if(clusterindices[i]==-1){    //if no one has claimed this point, make it a head
-//         heads.push_back(i);
-//         searchcount++;
-//         bigNN(cloud,cloud.points[i],clusterindices,cluster_tol,heads.size()-1);
-//       }
-//      }
-//      std::cout<<"searching took "<<g_tock(t0)<<" for "<<searchcount<<" searches"<<endl;
-//   }
+template <typename PointT>
+void segfast(pcl::PointCloud<PointT> &cloud, ClusterLabels &labels, double cluster_tol=.2,
+		const ClusterLimits &limits=ClusterLimits(), SegfastStats *stats=NULL){
+	SegfastWorkspace<PointT> workspace;
+	segfast(cloud,labels,workspace,cluster_tol,limits,stats);
+}
 
-//   template <typename PointT>
-//   void testNNs(pcl::PointCloud<PointT> &cloud, double cluster_tol=.2){
-//      double setupanntime,setupflanntime;
-//      timeval t0=g_tick();
-//      pcl::KdTreeANN<PointT> tree;
-//      tree.setInputCloud(cloud.makeShared());
-//      setupanntime= g_tock(t0); t0=g_tick();
-////      std::cout<<"ANN setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-//      pcl::KdTreeFLANN<PointT> ftree;
-//      ftree.setInputCloud(cloud.makeShared());
-//      setupflanntime= g_tock(t0); t0=g_tick();
-////      std::cout<<"FLANN setupcloud took "<<g_tock(t0)<<endl; t0=g_tick();
-//      vector<int> indices,indices2, indices3;
-//      vector<float> dists;
-//      double time1=0,time2=0,time3=0;
-//
-//      srand(getUsec());
-//      srand(0);
-//      for(int trialnum=0; trialnum<randseed;trialnum++){
-//         srand(getUsec());
-//        int ind = rand()%cloud.points.size();
-//        indices3.clear();
-//        indices2.clear();
-//        indices.clear();
-//        t0=g_tick();
-//        tree.radiusSearch(cloud.points[ind],cluster_tol,indices,dists);
-//        time1+=g_tock(t0);
-//        t0=g_tick();
-//        ftree.radiusSearch(cloud.points[ind],cluster_tol,indices3,dists);
-//        time3+=g_tock(t0);
-//        t0=g_tick();
-//        bigNN(cloud,cloud.points[ind],indices2,cluster_tol);
-//        time2+=g_tock(t0);
-////        if(indices.size() != indices2.size()){
-////           ROS_ERROR("trial: %d   index sizes %d and %d do not match!",trialnum,indices.size(),indices2.size());
-////           if(indices2.size()> indices.size())
-////              if(checkcluster(cloud,indices2,cluster_tol,ind))
-////                 ROS_ERROR("trial: %d   all points in indices2 are ok...",trialnum);
-////        }
-////
-////        for(uint i=0;i<indices.size();i++){
-////           bool found=false;
-////           for(uint j=0;j<indices2.size();j++){
-////              if(indices[i]==indices2[j]){
-////                 found=true;
-////                 break;
-////              }
-////           }
-////           if(!found){
-////              if(indices.size() != indices2.size()){
-////                 ROS_ERROR("index sizes %d and %d do not match!",indices.size(),indices2.size());
-////                 return;
-////              }
-////
-////           }
-//
-//
-////        }
-//      }
-//      float div=(float)randseed;
-//      ROS_INFO("%d size cloud, setup: ANN: %.3f, FLANN: %.3f  Ave Search: ANN: %.6f  FLANN: %.6f  naive: %.6f",cloud.points.size(), setupanntime,setupflanntime,time1/div,time3/div,time2/div);
-////      std::cout<<"searching took:  ANN: "<<time1/div<<" FLANN: "<<time3/div<<" naive: "<<time2/div<<" for "<<randseed<<" searches"<<endl;
-//   }
 
-//   //divides cloud into 8 clusters
-//   template <typename PointT>
-//   void planeseg(pcl::PointCloud<PointT> &cloud, double x, double y, double z){
-//      Eigen::Vector4f vec;
-//      pcl::compute3DCentroid(cloud,vec);
-//      timeval t0=g_tick();
-//      std::vector<int> ind;
-//      clusterindices.resize(cloud.points.size(),0);
-//      for(uint i=0;i<cloud.points.size(); i++){
-//         if(cloud.points[i].z > z) clusterindices[i] +=4;
-//         if(cloud.points[i].y > y) clusterindices[i] +=2;
-//         if(cloud.points[i].x > x) clusterindices[i] +=1;
-//      }
-//      std::cout<<"planeseg took:  "<<g_tock(t0)<<"  for "<<cloud.points.size()<<" indices."<<std::endl;
-//   }
+//one spatial slab of the cloud for segfastParallel. each slab is clustered on its own thread
+template <typename PointT>
+struct SegfastSlab{
+	pcl::PointCloud<PointT> cloud;   //the points in this slab
+	std::vector<int> inds;           //the index in the full cloud of each point in the slab
+	std::vector<std::vector<int> > clusters;  //clusters of slab indices
+	double cluster_tol;
+	SegfastStats stats;
+
+	void run(){
+		segfast(cloud,clusters,cluster_tol,1,&stats);
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief Same clustering as segfast, but the cloud is cut into slabs along its longest axis, and each slab is
+  * clustered on its own thread.  Clusters that come within cluster_tol of each other across a slab border are
+  * then stitched together, so the result is the same set of clusters the serial segfast finds.
+  * \param cloud the point cloud message
+  * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
+  * \param clusters the resultant clusters containing point indices (as a vector of vector of ints)
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param numthreads how many slabs/threads to use. 0 uses one per core
+  * \param stats if given, the counts and phase times summed over the slabs. totaltime is the wall clock time of the whole call
+  */
+template <typename PointT>
+void segfastParallel(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(),
+		int numthreads=0, SegfastStats *stats=NULL){
+	if(numthreads<=0) numthreads=boost::thread::hardware_concurrency();
+	if(numthreads<=1 || cloud.points.size()<2000){
+		segfast(cloud,clusters,cluster_tol,limits,stats);
+		return;
+	}
+	timeval t0=g_tick();
+
+	//cut along the axis with the largest extent
+	float minpt[3]={0,0,0},maxpt[3]={0,0,0};
+	bool first=true;
+	for(uint i=0;i<cloud.points.size();++i){
+		const PointT &p=cloud.points[i];
+		if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)) continue;
+		float v[3]={p.x,p.y,p.z};
+		for(int k=0;k<3;++k){
+			if(first || v[k]<minpt[k]) minpt[k]=v[k];
+			if(first || v[k]>maxpt[k]) maxpt[k]=v[k];
+		}
+		first=false;
+	}
+	int axis=0;
+	for(int k=1;k<3;++k)
+		if(maxpt[k]-minpt[k] > maxpt[axis]-minpt[axis]) axis=k;
+	std::vector<float> vals(cloud.points.size());
+	for(uint i=0;i<cloud.points.size();++i){
+		float v=(axis==0 ? cloud.points[i].x : (axis==1 ? cloud.points[i].y : cloud.points[i].z));
+		vals[i]=pcl_isfinite(v) ? v : minpt[axis];
+	}
 
+	//place the borders so each slab gets about the same number of points, but keep every slab wider
+	//than cluster_tol so that a pair of points within the tolerance never straddles more than one border
+	std::vector<float> borders,sorted(vals);
+	for(int k=1;k<numthreads;++k){
+		std::nth_element(sorted.begin(),sorted.begin()+k*sorted.size()/numthreads,sorted.end());
+		float b=sorted[k*sorted.size()/numthreads];
+		float prev=(borders.size() ? borders.back() : minpt[axis]);
+		if(b-prev > cluster_tol && maxpt[axis]-b > cluster_tol)
+			borders.push_back(b);
+	}
+	if(!borders.size()){
+		segfast(cloud,clusters,cluster_tol,limits,stats);
+		return;
+	}
+
+	std::vector<SegfastSlab<PointT> > slabs(borders.size()+1);
+	std::vector<int> slabof(cloud.points.size());
+	for(uint i=0;i<cloud.points.size();++i){
+		int s=std::upper_bound(borders.begin(),borders.end(),vals[i])-borders.begin();
+		slabof[i]=s;
+		slabs[s].cloud.points.push_back(cloud.points[i]);
+		slabs[s].inds.push_back(i);
+	}
+	boost::thread_group threads;
+	for(uint s=0;s<slabs.size();++s){
+		slabs[s].cloud.width=slabs[s].cloud.points.size();
+		slabs[s].cloud.height=1;
+		slabs[s].cluster_tol=cluster_tol;
+		if(slabs[s].cloud.points.size())
+			threads.create_thread(boost::bind(&SegfastSlab<PointT>::run,&slabs[s]));
+	}
+	threads.join_all();
+
+	//give every slab cluster a global label
+	std::vector<int> labels(cloud.points.size(),-1);
+	int numlabels=0;
+	for(uint s=0;s<slabs.size();++s)
+		for(uint c=0;c<slabs[s].clusters.size();++c,++numlabels)
+			for(uint j=0;j<slabs[s].clusters[c].size();++j)
+				labels[slabs[s].inds[slabs[s].clusters[c][j]]]=numlabels;
+
+	//stitch across each border: only points within cluster_tol of the border can connect to the other side.
+	//points with bad coordinates were not clustered, and stay at label -1
+	DisjointSets sets;
+	sets.reset(numlabels);
+	std::vector<int> indices;
+	for(uint b=0;b<borders.size();++b){
+		pcl::PointCloud<PointT> band;
+		std::vector<int> bandinds,below;
+		for(uint i=0;i<cloud.points.size();++i){
+			if(labels[i]<0) continue;
+			if(slabof[i]==(int)b+1 && vals[i] < borders[b]+cluster_tol){
+				band.points.push_back(cloud.points[i]);
+				bandinds.push_back(i);
+			}
+			else if(slabof[i]==(int)b && vals[i] >= borders[b]-cluster_tol)
+				below.push_back(i);
+		}
+		if(!band.points.size() || !below.size()) continue;
+		band.width=band.points.size(); band.height=1;
+		SpatialHash<PointT> bandindex(band,cluster_tol);
+		for(uint i=0;i<below.size();++i){
+			bandindex.NNN(cloud.points[below[i]],indices,cluster_tol);
+			for(uint j=0;j<indices.size();++j)
+				sets.join(labels[below[i]],labels[bandinds[indices[j]]]);
+		}
+	}
 
+	//label each point with its stitched cluster, and only list the points of the clusters that are kept
+	std::vector<int> rootlabel(numlabels,-1);
+	ClusterLabels flat;
+	flat.labels.resize(cloud.points.size());
+	int numstitched=0;
+	for(uint i=0;i<cloud.points.size();++i){
+		if(labels[i]<0){
+			flat.labels[i]=-1;
+			continue;
+		}
+		int root=sets.find(labels[i]);
+		if(rootlabel[root]==-1) rootlabel[root]=numstitched++;
+		flat.labels[i]=rootlabel[root];
+	}
+	int numclusters=flat.finish(numstitched,limits);
+	flat.toClusters(clusters);
+
+	if(stats){
+		stats->clear();
+		for(uint s=0;s<slabs.size();++s){
+			const SegfastStats &ss=slabs[s].stats;
+			stats->downsampletime+=ss.downsampletime;
+			stats->pairingtime+=ss.pairingtime;
+			stats->indextime+=ss.indextime;
+			stats->mergetime+=ss.mergetime;
+			stats->searchcount+=ss.searchcount;
+			stats->comparecount+=ss.comparecount;
+			stats->mergecount+=ss.mergecount;
+			stats->numheads+=ss.numheads;
+			stats->numloners+=ss.numloners;
+		}
+		stats->numpoints=cloud.points.size();
+		stats->numclusters=numclusters;
+		stats->totaltime=g_tock(t0);
+	}
+}
 
 
-};
+//how two sets of points, given only their bounding boxes, can stand relative to each other: every pair of their
+//points further apart than sqrt(distthresh) (BOXES_APART), every pair within it (BOXES_CLOSE), or it takes
+//looking at the points to tell (BOXES_UNSURE).  the boxes are lo/hi[0..2].  there is a little slack either way,
+//so rounding never makes a box test decide what only the points can
+enum BoxRelation{ BOXES_APART, BOXES_CLOSE, BOXES_UNSURE };
+inline BoxRelation compareBoxes(const float *lo1, const float *hi1, const float *lo2, const float *hi2, double distthresh){
+	double near2=0,far2=0;
+	for(int k=0;k<3;++k){
+		double gap=std::max(0.0,std::max((double)lo2[k]-hi1[k],(double)lo1[k]-hi2[k]));
+		double span=std::max((double)hi2[k]-lo1[k],(double)hi1[k]-lo2[k]);
+		near2+=gap*gap;
+		far2+=span*span;
+	}
+	if(near2 > distthresh*1.0001) return BOXES_APART;
+	if(far2 <= distthresh*0.9999) return BOXES_CLOSE;
+	return BOXES_UNSURE;
+}
+
+//for sets of points laid out end to end in pts (set c is pts[start[c]] to pts[start[c+1]-1]), with bounding boxes
+//lo/hi[3c..3c+2]: true if some point of set a is within sqrt(distthresh) of some point of set b.  The boxes settle
+//most pairs; comparecount, if given, counts the ones that had to be settled on the points
+inline bool setsTouch(const PointsSoA &pts, const std::vector<int> &start, const std::vector<float> &lo, const std::vector<float> &hi,
+		int a, int b, double distthresh, int *comparecount=NULL){
+	BoxRelation rel=compareBoxes(&lo[3*a],&hi[3*a],&lo[3*b],&hi[3*b],distthresh);
+	if(rel!=BOXES_UNSURE) return rel==BOXES_CLOSE;
+	if(comparecount) (*comparecount)++;
+	return anyPairWithin(pts,start[a],start[a+1]-start[a],pts,start[b],start[b+1]-start[b],distthresh);
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-/** \brief Decompose a Point Cloud into clusters based on the Euclidean distance between points. Uses Hierarchical Clustering, making it faster
+/** \brief Clustering for organized clouds (like the 640x480 clouds that come off the kinect).  Instead of building
+  * a search tree, the points within cluster_tol of a point are looked for in a window of pixels around it, which
+  * is sized from the point's depth so it is sure to hold all of them: a point q within cluster_tol of p lands within
+  * f*tol*(1+|x/z|)/(z-tol) pixels of p horizontally (same for y vertically), and anywhere in the image if p is
+  * closer to the camera than cluster_tol.  At the usual tolerances that is tens of pixels, so the window is not
+  * searched pixel by pixel.  Each row is cut into runs of neighboring pixels that are within cluster_tol of each
+  * other (at most 64 long), and runs whose windows meet are joined the way segfastVoxel joins voxels: on their
+  * bounding boxes, and point by point only when the boxes cannot tell.
+  * Points with non-finite coordinates are not put in any cluster.
   * \param cloud the point cloud message
   * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
-  * \param cclusters the resultant clusters containing point indices (as a vector of vector of ints)
-  * \param min_pts_per_cluster minimum number of points that a cluster may contain (default = 1)
+  * \param clusters the resultant clusters containing point indices (as a vector of vector of ints)
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param focal_length focal length of the camera in pixels, at a width of 640
+  * \param max_window largest half-width of the pixel window to search, 0 for no limit.  If some point needs a
+  *        bigger window than this, the cloud is handed to segfast instead
+  * \return true if the cloud was clustered on the image lattice, false if it fell back to segfast because it is
+  *        not organized or max_window was too small
   */
 template <typename PointT>
-void segfast(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2, int min_pts_per_cluster=1){
+bool segfastOrganized(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(),
+      double focal_length=525.0, int max_window=0){
+	if(cloud.height<=1 || cloud.width*cloud.height!=cloud.points.size()){
+		ROS_DEBUG("segfastOrganized: the cloud is not organized, clustering it with segfast");
+		segfast(cloud,clusters,cluster_tol,limits);
+		return false;
+	}
+	int width=cloud.width, height=cloud.height;
+	double f=focal_length*width/640.0;
+	double distthresh=cluster_tol*cluster_tol;
+	const int maxrun=64;  //keeps the boxes tight, and the point by point checks short
+
+	//cut the rows into runs.  the runs come out in raster order, and so do their points in pts
+	PointsSoA pts;
+	std::vector<int> runstart;           //the points of run r are pts[runstart[r]] to pts[runstart[r+1]-1]
+	std::vector<int> runrow,runu0,runu1; //the row of each run, and its first and last column
+	std::vector<int> winu,winv;          //the biggest window any of its points needs
+	std::vector<float> lo,hi;            //bounding box of each run
+	std::vector<int> chained;            //runs that were only cut off because they got too long
+	std::vector<int> rowfirst(height+1); //the runs in row v are rowfirst[v] to rowfirst[v+1]-1
+	std::vector<float> rowlo(height,std::numeric_limits<float>::max()),rowhi(height,-std::numeric_limits<float>::max()); //depth range of each row
+	std::vector<int> ptrun(cloud.points.size(),-1);
+	for(int v=0;v<height;++v){
+		rowfirst[v]=runstart.size();
+		int prev=-1;  //the last pixel of the current run, -1 if there is none
+		for(int u=0;u<width;++u){
+			int i=v*width+u;
+			const PointT &p=cloud.points[i];
+			if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)){
+				prev=-1;
+				continue;
+			}
+			int ru=width,rv=height;
+			if(p.z > cluster_tol){
+				ru=(int)std::min((double)width,ceil(f*cluster_tol*(1.0+fabs(p.x/p.z))/(p.z-cluster_tol)));
+				rv=(int)std::min((double)height,ceil(f*cluster_tol*(1.0+fabs(p.y/p.z))/(p.z-cluster_tol)));
+			}
+			if(max_window>0 && (ru>max_window || rv>max_window)){
+				ROS_DEBUG("segfastOrganized: a point at depth %f needs a window of %d x %d pixels, more than the %d allowed. clustering with segfast",
+						p.z,ru,rv,max_window);
+				segfast(cloud,clusters,cluster_tol,limits);
+				return false;
+			}
+			bool close=(prev!=-1 && pcl::squaredEuclideanDistance(p,cloud.points[prev]) <= distthresh);
+			int r=runstart.size()-1;
+			if(!close || u-runu0[r]>=maxrun){
+				if(close) chained.push_back(runstart.size());
+				r=runstart.size();
+				runstart.push_back(pts.size());
+				runrow.push_back(v);
+				runu0.push_back(u);
+				runu1.push_back(u);
+				winu.push_back(0);
+				winv.push_back(0);
+				float b[3]={p.x,p.y,p.z};
+				lo.insert(lo.end(),b,b+3);
+				hi.insert(hi.end(),b,b+3);
+			}
+			pts.push_back(p);
+			ptrun[i]=r;
+			runu1[r]=u;
+			winu[r]=std::max(winu[r],ru);
+			winv[r]=std::max(winv[r],rv);
+			lo[3*r]=std::min(lo[3*r],p.x);     hi[3*r]=std::max(hi[3*r],p.x);
+			lo[3*r+1]=std::min(lo[3*r+1],p.y); hi[3*r+1]=std::max(hi[3*r+1],p.y);
+			lo[3*r+2]=std::min(lo[3*r+2],p.z); hi[3*r+2]=std::max(hi[3*r+2],p.z);
+			rowlo[v]=std::min(rowlo[v],p.z);
+			rowhi[v]=std::max(rowhi[v],p.z);
+			prev=i;
+		}
+	}
+	int numruns=runstart.size();
+	rowfirst[height]=numruns;
+	runstart.push_back(pts.size());
+
+	//join the runs.  each run only looks forward in raster order: the runs after it in its own row, and the runs in
+	//the rows below that reach into its window.  the other half was covered when the earlier runs looked at it.
+	//the first pass only looks at the next row, which is where nearly all the joining on a surface happens.  then
+	//each row is grouped into stretches of runs that are already joined, and the second pass goes through the rest
+	//of the windows a stretch at a time, so a stretch that is joined already (or nowhere near) costs one check.
+	//near the camera the windows get tall, so rows that are nowhere near the run's depth are skipped whole
+	DisjointSets sets;
+	sets.reset(numruns);
+	for(uint k=0;k<chained.size();++k)
+		sets.join(chained[k]-1,chained[k]);
+	std::vector<int> segfirst(height+1);   //the stretches in row v are segfirst[v] to segfirst[v+1]-1
+	std::vector<int> segstart,segu0,segu1; //stretch s is runs segstart[s] to segstart[s+1]-1, columns segu0[s] to segu1[s]
+	std::vector<float> seglo,seghi;
+	for(int pass=0;pass<2;++pass){
+		if(pass==1){
+			for(int v=0;v<height;++v){
+				segfirst[v]=segstart.size();
+				for(int b=rowfirst[v];b<rowfirst[v+1];++b){
+					int s=segstart.size()-1;
+					if(b==rowfirst[v] || sets.find(b)!=sets.find(b-1)){
+						segstart.push_back(b);
+						segu0.push_back(runu0[b]);
+						segu1.push_back(runu1[b]);
+						seglo.insert(seglo.end(),&lo[3*b],&lo[3*b]+3);
+						seghi.insert(seghi.end(),&hi[3*b],&hi[3*b]+3);
+						continue;
+					}
+					segu1[s]=runu1[b];
+					for(int k=0;k<3;++k){
+						seglo[3*s+k]=std::min(seglo[3*s+k],lo[3*b+k]);
+						seghi[3*s+k]=std::max(seghi[3*s+k],hi[3*b+k]);
+					}
+				}
+			}
+			segfirst[height]=segstart.size();
+			segstart.push_back(numruns);
+		}
+		for(int r=0;r<numruns;++r){
+			int v=runrow[r], ulo=runu0[r]-winu[r], uhi=runu1[r]+winu[r];
+			int wlast=std::min(height-1,v+(pass==0 ? std::min(1,winv[r]) : winv[r]));
+			for(int w=(pass==0 ? v : v+2);w<=wlast;++w){
+				if(rowlo[w]-hi[3*r+2] > cluster_tol || lo[3*r+2]-rowhi[w] > cluster_tol) continue;
+				if(pass==0){
+					int b=r+1;
+					if(w!=v) //the first run in row w that ends at or after ulo.  the runs in a row are in order and do not overlap
+						b=std::lower_bound(runu1.begin()+rowfirst[w],runu1.begin()+rowfirst[w+1],ulo)-runu1.begin();
+					for(;b<rowfirst[w+1] && runu0[b]<=uhi;++b)
+						if(sets.find(r)!=sets.find(b) && setsTouch(pts,runstart,lo,hi,r,b,distthresh))
+							sets.join(r,b);
+					continue;
+				}
+				int s=std::lower_bound(segu1.begin()+segfirst[w],segu1.begin()+segfirst[w+1],ulo)-segu1.begin();
+				for(;s<segfirst[w+1] && segu0[s]<=uhi;++s){
+					if(sets.find(segstart[s])==sets.find(r)) continue;
+					if(compareBoxes(&lo[3*r],&hi[3*r],&seglo[3*s],&seghi[3*s],distthresh)==BOXES_APART) continue;
+					int b=std::lower_bound(runu1.begin()+segstart[s],runu1.begin()+segstart[s+1],ulo)-runu1.begin();
+					for(;b<segstart[s+1] && runu0[b]<=uhi;++b)
+						if(sets.find(r)!=sets.find(b) && setsTouch(pts,runstart,lo,hi,r,b,distthresh))
+							sets.join(r,b);
+				}
+			}
+		}
+	}
 
-    PtMap<PointT> pmap(cloud,cluster_tol);
+	std::vector<int> rootlabel(numruns,-1);
+	ClusterLabels flat;
+	flat.labels.assign(cloud.points.size(),-1);
+	int numlabels=0;
+	for(uint i=0;i<cloud.points.size();++i){
+		if(ptrun[i]==-1) continue;
+		int root=sets.find(ptrun[i]);
+		if(rootlabel[root]==-1) rootlabel[root]=numlabels++;
+		flat.labels[i]=rootlabel[root];
+	}
+	flat.finish(numlabels,limits);
+	flat.toClusters(clusters);
+	return true;
+}
 
-	timeval t0;
-	timeval ttot=g_tick();
-	t0=g_tick();
-	pmap.simpleDownsampleNNN2(cloud,cluster_tol);
-	cout<<"downsampleNNN2 took: "<<g_tock(t0)<<std::endl;
-	cout<<std::endl<<"cluster heads: "<<std::endl;
 
-	t0=g_tick();
-	int clusternum=pmap.analyzePairings();
-	cout<<"ptMap.analyzepairings took: "<<g_tock(t0)<<"  for "<<clusternum<<std::endl;
+//the bounding box of each voxel's points, where pts holds the points in voxel order, voxel c being
+//start[c] to start[c+1]-1.  lo and hi get three floats per voxel
+inline void voxelBoxes(const PointsSoA &pts, const std::vector<int> &start, std::vector<float> &lo, std::vector<float> &hi){
+	int numvoxels=start.size()-1;
+	lo.resize(3*numvoxels);
+	hi.resize(3*numvoxels);
+	for(int c=0;c<numvoxels;++c){
+		int s=start[c];
+		lo[3*c]=hi[3*c]=pts.x[s];
+		lo[3*c+1]=hi[3*c+1]=pts.y[s];
+		lo[3*c+2]=hi[3*c+2]=pts.z[s];
+		for(int e=s+1;e<start[c+1];++e){
+			lo[3*c]=std::min(lo[3*c],pts.x[e]);     hi[3*c]=std::max(hi[3*c],pts.x[e]);
+			lo[3*c+1]=std::min(lo[3*c+1],pts.y[e]); hi[3*c+1]=std::max(hi[3*c+1],pts.y[e]);
+			lo[3*c+2]=std::min(lo[3*c+2],pts.z[e]); hi[3*c+2]=std::max(hi[3*c+2],pts.z[e]);
+		}
+	}
+}
+
+//the voxel offsets (dx,dy,dz, one after the other) that can hold a point within cluster_tol of a point in this voxel,
+//for voxels vsize on a side: the ones whose gap to this voxel is at most cluster_tol.  only the forward half is
+//listed, since each pair of voxels is seen again from the other side
+inline void voxelOffsets(double cluster_tol, double vsize, std::vector<int> &offsets){
+	int reach=(int)ceil(cluster_tol/vsize);
+	offsets.clear();
+	for(int dx=0;dx<=reach;++dx)
+		for(int dy=-reach;dy<=reach;++dy)
+			for(int dz=-reach;dz<=reach;++dz){
+				if(dx==0 && (dy<0 || (dy==0 && dz<=0))) continue;
+				double gx=std::max(abs(dx)-1,0), gy=std::max(abs(dy)-1,0), gz=std::max(abs(dz)-1,0);
+				if((gx*gx+gy*gy+gz*gz)*vsize*vsize > cluster_tol*cluster_tol) continue;
+				offsets.push_back(dx); offsets.push_back(dy); offsets.push_back(dz);
+			}
+}
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief Clustering on a voxel grid, for coarse tolerances where segfast spends most of its time in radius searches.
+  * The voxels are cluster_tol/sqrt(3) on a side, so every point in a voxel is within cluster_tol of every other,
+  * and each occupied voxel starts out as one component.  Voxels close enough to hold a pair of points within
+  * cluster_tol are then joined: right away if their bounding boxes say every pair is close enough, otherwise
+  * only if some pair of their points actually is.  The result is exactly Euclidean clustering, in time linear in
+  * the points plus the occupied voxels.  Points with non-finite coordinates are not put in any cluster.
+  * \param cloud the point cloud message
+  * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
+  * \param clusters the resultant clusters containing point indices (as a vector of vector of ints)
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param stats if given, filled out with the timings and counts for this call (the voxels are counted as heads)
+  */
+template <typename PointT>
+void segfastVoxel(const pcl::PointCloud<PointT> &cloud, ClusterLabels &labels, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(),
+		SegfastStats *stats=NULL){
+	SegfastStats st;
+	timeval t0;
+	timeval ttot=g_tick();
+	double distthresh=cluster_tol*cluster_tol;
+	//a hair under tol/sqrt(3), so rounding can't leave two points in one voxel further apart than cluster_tol
+	double vsize=cluster_tol/sqrt(3.0)*0.999;
 
 	t0=g_tick();
-	pmap.swapOutLoners();
-	cout<<"swapOutLoners took: "<<g_tock(t0)<<std::endl;
+	HashGrid grid;
+	if(!grid.build(cloud,(const std::vector<int>*)NULL,vsize)){
+		//voxels sharing a key would be taken as one clique, joining points that are far apart
+		ROS_WARN("segfastVoxel: the cloud spans more than %d voxels of %f along an axis. clustering it with segfast",
+				HashGrid::maxcoord,vsize);
+		typename SegfastWorkspace<PointT>::Engine engine;
+		ClusterLabelsSink sink(labels);
+		engine.cluster(cloud,sink,cluster_tol,limits);
+		if(stats) *stats=engine.stats;
+		return;
+	}
+	int numvoxels=grid.cellkeys.size();
+	//the points, in voxel order
+	PointsSoA pts;
+	pts.gather(cloud,grid.entries);
+	std::vector<float> lo,hi;
+	voxelBoxes(pts,grid.cellstart,lo,hi);
+	st.indextime=g_tock(t0);
 
-	t0=g_tick();
-	pmap._sc2->useInds(pmap.heads);
-	cout<<"useinds took: "<<g_tock(t0)<<std::endl;
+	std::vector<int> offsets;
+	voxelOffsets(cluster_tol,vsize,offsets);
 
 	t0=g_tick();
-	pmap.checkClustering3();
-	pmap.addLonersBack();
-	cout<<"check cluster took: "<<g_tock(t0)<<std::endl;
-	cout<<"full cluster time: "<<g_tock(ttot)<<std::endl;
-	cout<<"cloud size: "<<cloud.points.size()<<" heads: "<<pmap.heads.size()<<" clusters: "<<pmap.clusters.size() <<std::endl;
+	DisjointSets sets;
+	sets.reset(numvoxels);
+	if(limits.bounded()) sets.weigh(grid.cellstart);
+	for(int c=0;c<numvoxels;++c){
+		int ix,iy,iz;
+		HashGrid::unpackKey(grid.cellkeys[c],ix,iy,iz);
+		for(uint o=0;o<offsets.size();o+=3){
+			int c2=grid.findCell(HashGrid::packKey(ix+offsets[o],iy+offsets[o+1],iz+offsets[o+2]));
+			if(c2==-1) continue;
+			int ra=sets.find(c),rb=sets.find(c2);
+			if(ra==rb) continue;
+			if(limits.bothTooBig(sets,ra,rb)) continue;
+			if(!setsTouch(pts,grid.cellstart,lo,hi,c,c2,distthresh,&st.comparecount)) continue;
+			sets.join(c,c2);
+			st.mergecount++;
+		}
+	}
+	st.mergetime=g_tock(t0);
+
+	//label the points in cloud order
+	std::vector<int> &rootlabel=labels.remap;
+	rootlabel.assign(numvoxels,-1);
+	labels.labels.resize(cloud.points.size());
+	int numlabels=0;
+	for(uint i=0;i<cloud.points.size();++i){
+		if(grid.tempcell[i]==-1){
+			labels.labels[i]=-1;
+			continue;
+		}
+		int root=sets.find(grid.tempcell[i]);
+		if(rootlabel[root]==-1) rootlabel[root]=numlabels++;
+		labels.labels[i]=rootlabel[root];
+	}
 
-	clusters.swap(pmap.clusters);
+	st.numclusters=labels.finish(numlabels,limits);
+	st.totaltime=g_tock(ttot);
+	st.numpoints=cloud.points.size();
+	st.numheads=numvoxels;
+	if(stats) *stats=st;
+}
 
+//the same, with the clusters as a vector of vector of ints
+template <typename PointT>
+void segfastVoxel(const pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(),
+		SegfastStats *stats=NULL){
+	ClusterLabels labels;
+	segfastVoxel(cloud,labels,cluster_tol,limits,stats);
+	labels.toClusters(clusters);
 }
 
 
-//give an approximate, quick segmentation:
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b SegfastTracker carries segfastVoxel's work from one frame of a stream to the next.  The voxels are laid
+  * out from a fixed origin, so a voxel has the same key in every frame.  A voxel whose points are exactly the same
+  * as last frame is unchanged, and so is everything about it and its unchanged neighbors: which pairs of them hold
+  * points within the tolerance is replayed from last frame rather than checked again, and only the voxels whose
+  * points changed have their borders checked.  It also remembers the label of each voxel's cluster, so the next
+  * frame's clusters can take over the labels of the clusters they overlap.
+  * A voxel only counts as unchanged if its points are bit for bit the same, so the reuse pays off on static or
+  * replayed data, but not on raw kinect frames: they have depth noise on every pixel, and next to nothing comes
+  * through unchanged.  When less than minreuse of a frame is unchanged, the tracker stops recording borders and
+  * does the same checks as segfastVoxel, plus the label carry-over.
+  */
 template <typename PointT>
-int quikseg(pcl::PointCloud<PointT> &cloud, std::vector<int>  clusterind, double cluster_tol=.2){
-
-    PtMap<PointT> pmap(cloud,cluster_tol);
+struct SegfastTracker{
+	double tol;                  //the tolerance the cached frame was clustered at, 0 if there is none
+	HashGrid grid,lastgrid;      //this frame's voxels and last frame's
+	std::vector<int> touching,lasttouching;  //pairs of voxels (one after the other) with points within tol
+	std::vector<int> voxellabel,lastvoxellabel;  //the label of each voxel's cluster, -1 if it was dropped
+	int nextlabel;               //the next label to give to a new cluster
+	int unchanged;               //how many voxels were unchanged on the last call
+	bool recorded;               //whether touching lists every touching pair of the last frame, so it can be replayed
+	double minreuse;             //the fraction of a frame's voxels that have to be unchanged for its borders to be recorded
+	int verbosity;
+
+	//scratch
+	PointsSoA pts;
+	std::vector<float> lo,hi;
+	std::vector<int> offsets,lastof,nowof,rootlabel;
+	DisjointSets sets;
+	ClusterLabels flat;
+	std::vector<std::pair<std::pair<int,int>,int> > votes;
+	std::vector<std::pair<int,std::pair<int,int> > > matches;
+	std::vector<int> labelused;
+
+	SegfastTracker(int _verbosity=0):minreuse(.25),verbosity(_verbosity){ clear(); }
+
+	//forget the last frame, e.g. after a cut in the stream
+	void clear(){
+		tol=0;
+		grid.clear();
+		lastgrid.clear();
+		touching.clear();
+		voxellabel.clear();
+		nextlabel=0;
+		unchanged=0;
+		recorded=false;
+	}
+};
 
+/** \brief Run segfastVoxel on the next frame of a stream, reusing what the tracker saw on the last frame.  Voxels
+  * whose points have not changed at all keep their borders with each other from last frame, and only the changed
+  * voxels are checked against their neighbors, so a mostly static scene costs little more than bucketing the
+  * points.  On noisy frames, where few voxels are exactly the same, it costs a little more than segfastVoxel.
+  * Each cluster then takes the label of the last frame's cluster that most of its voxels' points were in, so a
+  * cluster that has not changed much keeps its label from frame to frame.  New clusters get new labels.
+  * The clusters are exactly what segfastVoxel would give.
+  * \param cloud the point cloud message
+  * \param clusters the resultant clusters containing point indices (as a vector of vector of ints)
+  * \param labels the label of each cluster, stable across frames
+  * \param tracker what was learned from the last frame. updated for the next one
+  * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param stats if given, filled out with the timings and counts for this call (the voxels are counted as heads)
+  */
+template <typename PointT>
+void segfastTracked(const pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, std::vector<int> &labels,
+		SegfastTracker<PointT> &tracker, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(), SegfastStats *stats=NULL){
+	SegfastStats st;
 	timeval t0;
 	timeval ttot=g_tick();
-	t0=g_tick();
-	pmap.simpleDownsampleNNN2(cloud,cluster_tol);
-	cout<<"downsampleNNN2 took: "<<g_tock(t0)<<std::endl;
-	cout<<std::endl<<"cluster heads: "<<std::endl;
+	double distthresh=cluster_tol*cluster_tol;
+	double vsize=cluster_tol/sqrt(3.0)*0.999;
+	if(tracker.tol!=cluster_tol) tracker.clear();  //nothing carries over between tolerances
+	tracker.tol=cluster_tol;
 
 	t0=g_tick();
-	int clusternum=pmap.analyzePairings();
-	cout<<"ptMap.analyzepairings took: "<<g_tock(t0)<<"  for "<<clusternum<<std::endl;
+	HashGrid &grid=tracker.grid, &lastgrid=tracker.lastgrid;
+	std::swap(grid,lastgrid);
+	tracker.touching.swap(tracker.lasttouching);
+	tracker.voxellabel.swap(tracker.lastvoxellabel);
+	float origin[3]={0,0,0};
+	if(!grid.build(cloud,(const std::vector<int>*)NULL,vsize,origin)){
+		//the voxel keys would wrap around. cluster without the tracker, and start over on the next frame
+		ROS_WARN("segfastTracked: the cloud reaches more than %d voxels of %f from the origin. clustering it untracked",
+				HashGrid::maxcoord,vsize);
+		int nextlabel=tracker.nextlabel;  //still don't reuse the labels handed out so far
+		tracker.clear();
+		tracker.nextlabel=nextlabel;
+		segfastVoxel(cloud,clusters,cluster_tol,limits,stats);
+		labels.resize(clusters.size());
+		for(uint c=0;c<labels.size();++c)
+			labels[c]=tracker.nextlabel++;
+		return;
+	}
+	int numvoxels=grid.cellkeys.size();
+	PointsSoA &pts=tracker.pts;
+	pts.gather(cloud,grid.entries);
+	voxelBoxes(pts,grid.cellstart,tracker.lo,tracker.hi);
+	st.indextime=g_tock(t0);
+
+	//match the voxels to last frame's. lastof[c] is the voxel with the same key last frame, or -1;
+	//nowof[lc] is this frame's voxel for last frame's voxel lc, if its points are exactly the same, or -1
+	t0=g_tick();
+	std::vector<int> &lastof=tracker.lastof, &nowof=tracker.nowof;
+	lastof.assign(numvoxels,-1);
+	nowof.assign(lastgrid.built() ? lastgrid.cellkeys.size() : 0,-1);
+	tracker.unchanged=0;
+	for(int c=0;c<numvoxels && lastgrid.built();++c){
+		int lc=lastgrid.findCell(grid.cellkeys[c]);
+		if(lc==-1) continue;
+		lastof[c]=lc;
+		int n=grid.cellstart[c+1]-grid.cellstart[c];
+		if(n!=lastgrid.cellstart[lc+1]-lastgrid.cellstart[lc]) continue;
+		if(!std::equal(grid.xyz.begin()+3*grid.cellstart[c],grid.xyz.begin()+3*grid.cellstart[c+1],
+				lastgrid.xyz.begin()+3*lastgrid.cellstart[lc])) continue;
+		nowof[lc]=c;
+		tracker.unchanged++;
+	}
+
+	//pairs of unchanged voxels touch now exactly when they did last frame, if last frame's pairs were recorded.
+	//recording means checking every pair, even ones already joined, so it is only done when enough of the frame
+	//came through unchanged for the next frame to gain from it
+	bool replay=tracker.recorded;
+	bool record=(tracker.unchanged >= tracker.minreuse*numvoxels);
+	DisjointSets &sets=tracker.sets;
+	sets.reset(numvoxels);
+	std::vector<int> &touching=tracker.touching, &lasttouching=tracker.lasttouching;
+	touching.clear();
+	for(uint p=0;p<lasttouching.size() && replay;p+=2){
+		int a=nowof[lasttouching[p]], b=nowof[lasttouching[p+1]];
+		if(a==-1 || b==-1) continue;
+		sets.join(a,b);
+		touching.push_back(a);
+		touching.push_back(b);
+	}
 
-	for(uint i=0;i<pmap.clusterindices.size();++i)
-		pmap.clusterindices[i]=pmap.clusterindices2[pmap.clusterindices[i]];
+	//the changed voxels check their borders: with every neighbor that is unchanged, and with the changed ones in
+	//the forward half only, since those pairs are seen again from the other side.  without a replay, every voxel
+	//counts as changed, which leaves exactly segfastVoxel's checks
+	std::vector<int> &offsets=tracker.offsets;
+	voxelOffsets(cluster_tol,vsize,offsets);
+	for(int c=0;c<numvoxels;++c){
+		if(replay && lastof[c]!=-1 && nowof[lastof[c]]==c) continue;
+		int ix,iy,iz;
+		HashGrid::unpackKey(grid.cellkeys[c],ix,iy,iz);
+		for(uint o=0;o<offsets.size();o+=3)
+			for(int dir=1;dir>=(replay ? -1 : 1);dir-=2){
+				int c2=grid.findCell(HashGrid::packKey(ix+dir*offsets[o],iy+dir*offsets[o+1],iz+dir*offsets[o+2]));
+				if(c2==-1) continue;
+				bool changed2=(!replay || lastof[c2]==-1 || nowof[lastof[c2]]!=c2);
+				if(changed2 && dir==-1) continue;
+				if(!record && sets.find(c)==sets.find(c2)) continue;
+				if(!setsTouch(pts,grid.cellstart,tracker.lo,tracker.hi,c,c2,distthresh,&st.comparecount)) continue;
+				if(record){
+					touching.push_back(c);
+					touching.push_back(c2);
+				}
+				if(sets.join(c,c2)) st.mergecount++;
+			}
+	}
+	tracker.recorded=record;
+	st.mergetime=g_tock(t0);
+
+	//label the points in cloud order
+	ClusterLabels &flat=tracker.flat;
+	std::vector<int> &rootlabel=tracker.rootlabel;
+	rootlabel.assign(numvoxels,-1);
+	flat.labels.resize(cloud.points.size());
+	int numlabels=0;
+	for(uint i=0;i<cloud.points.size();++i){
+		if(grid.tempcell[i]==-1){
+			flat.labels[i]=-1;
+			continue;
+		}
+		int root=sets.find(grid.tempcell[i]);
+		if(rootlabel[root]==-1) rootlabel[root]=numlabels++;
+		flat.labels[i]=rootlabel[root];
+	}
+	st.numclusters=flat.finish(numlabels,limits);
+	flat.toClusters(clusters);
+
+	//every voxel that was there last frame votes, by its number of points, for its cluster to take its old label
+	std::vector<std::pair<std::pair<int,int>,int> > &votes=tracker.votes;  //((cluster,label),points)
+	votes.clear();
+	for(int c=0;c<numvoxels;++c){
+		int cl=flat.labels[grid.entries[grid.cellstart[c]]];
+		if(lastof[c]==-1 || cl==-1 || tracker.lastvoxellabel[lastof[c]]==-1) continue;
+		votes.push_back(std::make_pair(std::make_pair(cl,tracker.lastvoxellabel[lastof[c]]),grid.cellstart[c+1]-grid.cellstart[c]));
+	}
+	std::sort(votes.begin(),votes.end());
+	std::vector<std::pair<int,std::pair<int,int> > > &matches=tracker.matches;  //(-points,(cluster,label))
+	matches.clear();
+	for(uint v=0;v<votes.size();){
+		uint w=v;
+		int support=0;
+		for(;w<votes.size() && votes[w].first==votes[v].first;++w) support+=votes[w].second;
+		matches.push_back(std::make_pair(-support,votes[v].first));
+		v=w;
+	}
+	//hand out the old labels, best supported match first.  each label and each cluster is used once
+	std::sort(matches.begin(),matches.end());
+	labels.assign(clusters.size(),-1);
+	std::vector<int> &labelused=tracker.labelused;
+	labelused.assign(tracker.nextlabel,0);
+	for(uint m=0;m<matches.size();++m){
+		int c=matches[m].second.first, l=matches[m].second.second;
+		if(labels[c]!=-1 || labelused[l]) continue;
+		labels[c]=l;
+		labelused[l]=1;
+	}
+	for(uint c=0;c<labels.size();++c)
+		if(labels[c]==-1) labels[c]=tracker.nextlabel++;
+	tracker.voxellabel.resize(numvoxels);
+	for(int c=0;c<numvoxels;++c){
+		int cl=flat.labels[grid.entries[grid.cellstart[c]]];
+		tracker.voxellabel[c]=(cl==-1 ? -1 : labels[cl]);
+	}
 
-	clusterind.swap(pmap.clusterindices);
-	return clusternum;
+	st.totaltime=g_tock(ttot);
+	st.numpoints=cloud.points.size();
+	st.numheads=numvoxels;
+	if(tracker.verbosity>0) std::cout<<"segfastTracked: "<<tracker.unchanged<<" of "<<numvoxels<<" voxels unchanged, "
+			<<st.numclusters<<" clusters in "<<st.totaltime<<endl;
+	if(stats) *stats=st;
 }
 
-//give an approximate, quick segmentation:
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b SingleLinkageTree answers Euclidean clustering for many tolerances on the same cloud.  build() finds
+  * the minimum spanning forest of the cloud, using only edges up to max_tol, and keeps its edges sorted by length.
+  * That is the single linkage merge tree: the clusters at any tolerance up to max_tol are what you get by joining
+  * just the edges that are no longer than it, so each cut() is one pass over the edges and the points.
+  * The clusters are the same ones segfast and pcl's extractEuclideanClusters find.
+  */
 template <typename PointT>
-void quikdownsample(pcl::PointCloud<PointT> &cloud, std::vector<int>  heads, double cluster_tol=.2){
+class SingleLinkageTree{
+	struct Edge{
+		float dist2;  //squared length
+		int a,b;
+		bool operator<(const Edge &e) const { return dist2<e.dist2; }
+	};
+	//a strict order on the edges, so equal lengths are always broken the same way
+	static bool lighter(const Edge &e, const Edge &f){
+		if(e.dist2!=f.dist2) return e.dist2<f.dist2;
+		return e.a<f.a || (e.a==f.a && e.b<f.b);
+	}
+	std::vector<Edge> merges;  //the tree: edges of the minimum spanning forest, shortest first
+	int numpoints;
+	double maxtol;
+
+	//scratch
+	std::vector<int> inds,rootlabel;
+	DisjointSets sets;
+
+public:
+	SingleLinkageTree(){ numpoints=0; maxtol=0; }
+
+	/** \brief build the tree for cloud.  The tree is grown one band of edge lengths at a time: the bands double
+	  * up to max_tol, starting at max_tol/8.  For each band the points are bucketed in cells as wide as
+	  * the band, and Boruvka rounds join each component to the closest other component within the band, until no
+	  * two are that close.  Neighboring cells that are both all in the same component are not searched again, which
+	  * is most of them once the shorter bands have joined up the dense parts.  Only the cheapest edge out of each
+	  * component is kept during a round, so memory goes with the points and cells, not the pairs within max_tol.
+	  */
+	void build(const pcl::PointCloud<PointT> &cloud, double max_tol){
+		numpoints=cloud.points.size();
+		maxtol=max_tol;
+		merges.clear();
+		sets.reset(numpoints);
+
+		//the bands, smallest first.  the smallest cells still have to span the cloud within the range of the grid keys
+		float lo[3]={0,0,0},hi[3]={0,0,0};
+		bool first=true;
+		for(int i=0;i<numpoints;++i){
+			const PointT &p=cloud.points[i];
+			if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)) continue;
+			float v[3]={p.x,p.y,p.z};
+			for(int k=0;k<3;++k){
+				if(first || v[k]<lo[k]) lo[k]=v[k];
+				if(first || v[k]>hi[k]) hi[k]=v[k];
+			}
+			first=false;
+		}
+		double minradius=std::max(hi[0]-lo[0],std::max(hi[1]-lo[1],hi[2]-lo[2]))/(1<<19);
+		std::vector<double> radii(1,max_tol);
+		while(radii.size()<4 && radii.back()/2>minradius) radii.push_back(radii.back()/2);
+		std::reverse(radii.begin(),radii.end());
+
+		HashGrid grid;
+		std::vector<int> cellroot,entryroot,cellpairs,touched;
+		Edge none={std::numeric_limits<float>::max(),-1,-1};
+		std::vector<Edge> cheapest(numpoints,none);  //the shortest edge out of each component this round, at its root
+		for(uint j=0;j<radii.size();++j){
+			float r2=radii[j]*radii[j];
+			grid.build(cloud,(const std::vector<int>*)NULL,radii[j]);
+			int numcells=grid.cellkeys.size();
+			//each cell paired with itself and the forward half of its neighbors. the other half see it as theirs
+			cellpairs.clear();
+			for(int c=0;c<numcells;++c){
+				int ix,iy,iz;
+				HashGrid::unpackKey(grid.cellkeys[c],ix,iy,iz);
+				for(int d=13;d<27;++d){
+					int c2=(d==13 ? c : grid.findCell(HashGrid::packKey(ix+d/9-1,iy+(d/3)%3-1,iz+d%3-1)));
+					if(c2==-1) continue;
+					cellpairs.push_back(c);
+					cellpairs.push_back(c2);
+				}
+			}
+			entryroot.resize(grid.entries.size());
+			cellroot.resize(numcells);
+			while(true){
+				//the component of each point, and of each cell: -1 if its points are mixed
+				for(int c=0;c<numcells;++c){
+					cellroot[c]=entryroot[grid.cellstart[c]]=sets.find(grid.entries[grid.cellstart[c]]);
+					for(int e=grid.cellstart[c]+1;e<grid.cellstart[c+1];++e){
+						entryroot[e]=sets.find(grid.entries[e]);
+						if(entryroot[e]!=cellroot[c]) cellroot[c]=-1;
+					}
+				}
+				//drop the cell pairs that are all one component now; they stay that way
+				uint kept=0;
+				for(uint p=0;p<cellpairs.size();p+=2){
+					int c=cellpairs[p],c2=cellpairs[p+1];
+					if(cellroot[c]!=-1 && cellroot[c]==cellroot[c2]) continue;
+					cellpairs[kept++]=c;
+					cellpairs[kept++]=c2;
+				}
+				cellpairs.resize(kept);
+				if(cellpairs.empty()) break;
+
+				for(uint p=0;p<cellpairs.size();p+=2){
+					int c=cellpairs[p],c2=cellpairs[p+1];
+					for(int e=grid.cellstart[c];e<grid.cellstart[c+1];++e)
+						for(int e2=(c2==c ? e+1 : grid.cellstart[c2]);e2<grid.cellstart[c2+1];++e2){
+							int ra=entryroot[e],rb=entryroot[e2];
+							if(ra==rb) continue;
+							float dx=grid.xyz[3*e]-grid.xyz[3*e2], dy=grid.xyz[3*e+1]-grid.xyz[3*e2+1], dz=grid.xyz[3*e+2]-grid.xyz[3*e2+2];
+							Edge edge={dx*dx+dy*dy+dz*dz,std::min(grid.entries[e],grid.entries[e2]),std::max(grid.entries[e],grid.entries[e2])};
+							if(edge.dist2>r2) continue;
+							if(cheapest[ra].a==-1) touched.push_back(ra);
+							if(cheapest[rb].a==-1) touched.push_back(rb);
+							if(lighter(edge,cheapest[ra])) cheapest[ra]=edge;
+							if(lighter(edge,cheapest[rb])) cheapest[rb]=edge;
+						}
+				}
+				//with ties broken the same way everywhere, joining every component's cheapest edge can't make a cycle
+				int joined=0;
+				for(uint t=0;t<touched.size();++t){
+					Edge &edge=cheapest[touched[t]];
+					if(sets.join(edge.a,edge.b)){
+						merges.push_back(edge);
+						joined++;
+					}
+					edge=none;
+				}
+				touched.clear();
+				if(!joined) break;
+			}
+		}
+		std::sort(merges.begin(),merges.end());
+	}
 
-    PtMap<PointT> pmap(cloud,cluster_tol);
+	double maxTolerance(){ return maxtol; }
 
-	timeval t0;
+	//the length of each merge in the tree, shortest first.  The cluster count only changes at these tolerances
+	void mergeDistances(std::vector<double> &out){
+		out.resize(merges.size());
+		for(uint m=0;m<merges.size();++m)
+			out[m]=sqrt(merges[m].dist2);
+	}
+
+	/** \brief label every point with its cluster at this tolerance.  returns the number of clusters */
+	int cut(double cluster_tol, std::vector<int> &labels){
+		if(cluster_tol>maxtol){
+			ROS_WARN("SingleLinkageTree: tolerance %f is past the %f the tree was built to. Cutting at %f",cluster_tol,maxtol,maxtol);
+			cluster_tol=maxtol;
+		}
+		float r2=cluster_tol*cluster_tol;
+		sets.reset(numpoints);
+		for(uint m=0;m<merges.size() && merges[m].dist2<=r2;++m)
+			sets.join(merges[m].a,merges[m].b);
+		labels.resize(numpoints);
+		rootlabel.assign(numpoints,-1);
+		int numclusters=0;
+		for(int i=0;i<numpoints;++i){
+			int root=sets.find(i);
+			if(rootlabel[root]==-1) rootlabel[root]=numclusters++;
+			labels[i]=rootlabel[root];
+		}
+		return numclusters;
+	}
+
+	/** \brief the clusters at this tolerance, in the same form segfast gives them */
+	void cut(double cluster_tol, std::vector<std::vector<int> > &clusters, int min_pts_per_cluster=1){
+		int numclusters=cut(cluster_tol,inds);
+		clusters.resize(numclusters);
+		for(int c=0;c<numclusters;++c)
+			clusters[c].clear();
+		for(int i=0;i<numpoints;++i)
+			clusters[inds[i]].push_back(i);
+		numclusters=0;
+		for(uint c=0;c<clusters.size();++c)
+			if((int)clusters[c].size() >= min_pts_per_cluster)
+				clusters[c].swap(clusters[numclusters++]);
+		clusters.resize(numclusters);
+	}
+};
+
+
+//give an approximate, quick segmentation: segfast's heads, joined where they claimed the same point, without
+//checking the gaps between them.  clusterind gets the cluster of each point (-1 for bad coordinates)
+template <typename PointT>
+int quikseg(pcl::PointCloud<PointT> &cloud, std::vector<int> &clusterind, double cluster_tol=.2, SegfastStats *stats=NULL){
+	typename SegfastWorkspace<PointT>::Engine engine;
 	timeval ttot=g_tick();
-	t0=g_tick();
-	pmap.simpleDownsampleNNN(cloud,cluster_tol);
-	heads.swap(pmap.heads);
-	cout<<"downsampleNNN took: "<<g_tock(t0)<<std::endl;
+	engine.pickHeads(typename pcl::PointCloud<PointT>::ConstPtr(&cloud,NullDeleter()),cluster_tol);
+	int clusternum=engine.labelPoints(clusterind);
+	engine.stats.totaltime=g_tock(ttot);
+	engine.stats.numclusters=clusternum;
+	if(stats) *stats=engine.stats;
+	return clusternum;
 }
 
-//a debug function to figure out where segfast goes wrong.
+//give an approximate, quick downsampling: the heads segfast picks, such that every point is within cluster_tol of one
 template <typename PointT>
-void checksegfast(pcl::PointCloud<PointT> &cloud, std::vector<int>  &labels, double cluster_tol=.2, int min_pts_per_cluster=1){
+void quikdownsample(pcl::PointCloud<PointT> &cloud, std::vector<int> &heads, double cluster_tol=.2){
+	typename SegfastWorkspace<PointT>::Engine engine;
+	engine.pickHeads(typename pcl::PointCloud<PointT>::ConstPtr(&cloud,NullDeleter()),cluster_tol);
+	heads.swap(engine.heads);
+}
 
-    PtMap<PointT> pmap(cloud,cluster_tol);
+//a debug function to figure out where segfast goes wrong: runs it one phase at a time, printing as it goes
+template <typename PointT>
+void checksegfast(pcl::PointCloud<PointT> &cloud, std::vector<int>  &labels, double cluster_tol=.2, int min_pts_per_cluster=1){
+	typename SegfastWorkspace<PointT>::Engine engine;
+	ClusterLimits limits(min_pts_per_cluster);
 
 	timeval t0;
 	timeval ttot=g_tick();
 	t0=g_tick();
-	pmap.simpleDownsampleNNN2(cloud,cluster_tol);
-	cout<<"downsampleNNN2 took: "<<g_tock(t0)<<std::endl;
-	cout<<std::endl<<"cluster heads: "<<std::endl;
+	engine.pickHeads(typename pcl::PointCloud<PointT>::ConstPtr(&cloud,NullDeleter()),cluster_tol);
+	cout<<"pickHeads took: "<<g_tock(t0)<<"  for "<<engine.heads.size()<<" heads"<<std::endl;
 
 	t0=g_tick();
-	int clusternum=pmap.analyzePairings();
-	cout<<"ptMap.analyzepairings took: "<<g_tock(t0)<<"  for "<<clusternum<<std::endl;
-
+	engine.joinHeads(cloud,limits);
+	cout<<"joinHeads took: "<<g_tock(t0)<<"  ("<<engine.stats.pairingtime<<" pairing, "<<engine.stats.mergetime<<" merging) for "
+	    <<engine.candidates.size()/2<<" candidate pairs, "<<engine.stats.mergecount<<" merges"<<std::endl;
 
 	t0=g_tick();
-	pmap.swapOutLoners();
-	cout<<"swapOutLoners took: "<<g_tock(t0)<<std::endl;
-
-	t0=g_tick();
-	pmap._sc2->useInds(pmap.heads);
-	cout<<"useinds took: "<<g_tock(t0)<<std::endl;
-
-	t0=g_tick();
-	pmap.checkClustering3();
-	pmap.addLonersBack();
-	cout<<"check cluster took: "<<g_tock(t0)<<std::endl;
+	ClusterLabels flat;
+	int numclusters=flat.finish(engine.labelPoints(flat.labels),limits);
+	labels.swap(flat.labels);
+	cout<<"labeling took: "<<g_tock(t0)<<std::endl;
 	cout<<"full cluster time: "<<g_tock(ttot)<<std::endl;
-	cout<<"cloud size: "<<cloud.points.size()<<" heads: "<<pmap.heads.size()<<" clusters: "<<pmap.clusters.size() <<std::endl;
-
-
+	cout<<"cloud size: "<<cloud.points.size()<<" heads: "<<engine.heads.size()<<" clusters: "<<numclusters<<std::endl;
 }
 
 
-
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /** \brief Decompose a Point Cloud into clusters based on the Euclidean distance between points. Uses Hierarchical Clustering, making it faster
   * \param cloud the point cloud message
   * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
   * \param cclusters the resultant clusters containing point indices (as a vector of vector of ints)
-  * \param min_pts_per_cluster minimum number of points that a cluster may contain (default = 1)
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param morton_order cluster a copy of the cloud sorted into Morton order, which keeps neighbors close in memory on big clouds
+  * \param clusterstats if given, filled with the ClusterStats of each cluster while the points are being labeled
   */
 template <typename PointT>
-void extractEuclideanClustersFast2(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2, int min_pts_per_cluster=1){
-   double smaller_tol = cluster_tol/2.1;
-   pcl::KdTreeFLANN<PointT> tree,tree2;
-   tree.setInputCloud(cloud.makeShared());
-   vector<int> minitree(cloud.points.size(),-1);
-   vector<int> heads,indices;
-   vector<float> dists;
-
-   //First 'downsample' the points into clusters slightly less than half the cluster tolerance
-   //minitree keeps track of who each point belongs to (which is an index of the 'head' array)
-   for(uint i=0; i<cloud.points.size();i++){
-     if(minitree[i]==-1){    //if no one has claimed this point, make it a head
-        heads.push_back(i);
-        if(!tree.radiusSearch(cloud,i,smaller_tol,indices,dists))  //find all the points close to this point
-           ROS_WARN("radius search failed!");
-        for(uint j=0;j<indices.size();j++){
-           minitree[indices[j]]=heads.size()-1; //assign these points to the current head.
-                                       // this overwrites previous claims, but it's ok
-        }
-     }
+void extractEuclideanClustersFast2(pcl::PointCloud<PointT> &cloud, std::vector<std::vector<int> > &clusters, double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(),
+      bool morton_order=false, std::vector<ClusterStats> *clusterstats=NULL){
+   if(morton_order){
+      //cluster a copy sorted into Morton order, then map the indices back
+      std::vector<int> order;
+      pcl::PointCloud<PointT> sorted;
+      mortonOrder(cloud,cluster_tol,order);
+      reorderCloud(cloud,order,sorted);
+      extractEuclideanClustersFast2(sorted,clusters,cluster_tol,limits,false,clusterstats);
+      for(uint c=0;c<clusters.size();++c)
+         for(uint i=0;i<clusters[c].size();++i)
+            clusters[c][i]=order[clusters[c][i]];
+      return;
    }
+   EuclideanClusterEngine<PointT,KdIndex<PointT>,GrabSeeds,ExactMerge> engine;
+   ClusterVectorSink sink(clusters,clusterstats);
+   engine.cluster(cloud,sink,cluster_tol,limits);
+}
 
-   //now, we have much fewer points to cluster, but since the initial downsampling was less than
-   //half the cluster tolerance,we are guaranteed to find all the points within the tolerance
-   //(except if  [ clustertol < distance between heads < cluster_tol+ smaller cluster tol] AND the head closest points in the two heads are < cluster_tol
-   //The next code block deals with that...
-   tree2.setInputCloud(cloud.makeShared(),boost::make_shared<std::vector<int> >  (heads));
-   int searching,currenthead;
-   //heads2 is the cluster id.  we now search to make sure we check all the points in our cluster
-   //minitree2 corresponds to the heads array, so the points in minitree2 are at heads[i]
-   std::vector<int> heads2, minitree2(heads.size(),-1);
-   std::list<int> tosearch;
-   for(uint i=0; i<minitree2.size();i++){
-     if(minitree2[i]==-1){
-        heads2.push_back(heads[i]);
-        tosearch.push_back(i);
-        currenthead=heads2.size()-1; //references an index in heads2
-        minitree2[i]=currenthead;
-        while(tosearch.size()>0){
-           searching=tosearch.front();
-           tosearch.pop_front();
-           if(!tree2.radiusSearch(cloud.points[heads[searching]],cluster_tol,indices,dists))
-              cout<<"radius search failed!"<<endl;
-           for(uint j=0;j<indices.size();j++)
-              if(minitree2[indices[j]]==-1){//found untouched point (which means this root touched it)
-                 minitree2[indices[j]]=currenthead; //claim it
-                 tosearch.push_back(indices[j]);   //add it to list of points to search
-              }
-        }
-     }
-
-   }
-   clusters.resize(heads2.size());
-   //now, for each point in the cloud find its head --> then the head it clustered to. that is its cluster id!
-   for(uint j=0;j<minitree.size();j++){
-     clusters[minitree2[minitree[j]]].push_back(j);
-   }
-   //now we need to check to see if any of the heads that were NOT clustered together are closer than cluster_tol+smaller_tol.
-   //This covers the exception noted in the code block above
-   //this is where an adversary could really kill this algorithm, since this check could be polynomial in cloud size. in real circumstances, it is very quick.
-   vector<int> indices1;
-   vector<float> dists1;
-   double distthresh=cluster_tol*cluster_tol; //radius search gives squared distances...
-   double automergethresh=cluster_tol*cluster_tol/4.0; //pts are always in same clustr if they are both less than half the tolerance away from the same point
-   for(uint i=0; i<minitree2.size();i++){ //for every head
-      tree2.radiusSearch(cloud.points[heads[i]],cluster_tol+2*smaller_tol,indices,dists);
-      for(uint j=0;j<indices.size();j++){ //for every head that is close to this head
-         if(minitree2[indices[j]] != minitree2[i]){//if the two heads are not in the same cluster (and only check each combo once)
-            //now we have to find if there is a point between head a and head b that is < cluster_tol from both
-            //our best chance of finding it is to start searching at a point halfway between them
-            PointT heada=cloud.points[heads[i]], headb=cloud.points[heads[indices[j]]];
-            PointT inbetween;
-            inbetween.x=(heada.x+headb.x)/2.0;
-            inbetween.y=(heada.y+headb.y)/2.0;
-            inbetween.z=(heada.z+headb.z)/2.0;
-            if(!tree.radiusSearch(inbetween,cluster_tol,indices1,dists1)){ //search in the full tree
-               //nothing close to either cluster. these clusters are separate, so don't consider
-               continue; //go to next j
-            }
-            //must match all points that return against each other
-            bool shouldmerge=false;
-            int mergefrom,mergeinto;
-            for(int k=0;k<indices1.size()-1;k++){
-                for(uint m=k+1;m<indices1.size();m++){
-                  if(minitree2[minitree[indices1[k]]] != minitree2[minitree[indices1[m]]]) //if different clusters
-                     if((dists1[k]<automergethresh && dists1[m]<automergethresh) ||
-                     (squaredEuclideanDistance(cloud.points[indices1[k]],cloud.points[indices1[m]] ) < distthresh)){
-                        mergefrom=minitree2[minitree[indices1[k]]];
-                        mergeinto=minitree2[minitree[indices1[m]]];
-                        if(!((mergefrom !=minitree2[i] && mergefrom !=minitree2[indices[j]]) || (mergeinto !=minitree2[i] && mergeinto !=minitree2[indices[j]]))){
-                        shouldmerge=true;
-                        break;  //TODO: shouldn't actually break, but rather see if multiple clusters should merge
-                        }
-                     }
-
-                }
-               if(shouldmerge){
-
-                  //there is a point that these two clusters share -> they should be merged
-//                  if(globalverbose)
-//                     ROS_INFO("head %d (in cluster %d) shares a point with head %d (in cluster %d). Merging cluster %d (%d pts) into cluster %d (%d pts)",
-//                     i,minitree2[i],indices[j],minitree2[indices[j]],minitree2[indices[j]],clusters[minitree2[indices[j]]].size(), minitree2[i],  clusters[minitree2[i]].size());
-                  //rename all heads in cluster b to cluster a
-                  int clusterb=minitree2[indices[j]];
-                  for(uint m=0;m<minitree2.size();m++){
-                     if(minitree2[m]==clusterb) minitree2[m]=minitree2[i];
-                  }
-                  break;
-               } //if the point is shared
-            } //for every point close to both heads
-         } //if a head is close, and from a different cluster
-      }//for every nearby head
-   }  //for every head
-
-   clusters.clear();
-   clusters.resize(heads2.size());
-   //now, for each point in the cloud find its head --> then the head it clustered to. that is its cluster id!
-   for(uint j=0;j<minitree.size();j++){
-     clusters[minitree2[minitree[j]]].push_back(j);
-   }
-   //erase the deleted clusters, and the ones under the minimum size
-   std::vector<int> deletedclusters;
-   for(int i=clusters.size()-1;i>=0; i--)
-      if(clusters[i].size() < min_pts_per_cluster){
-         clusters.erase(clusters.begin()+i);
-         deletedclusters.push_back(i);
-      }
+/** \brief The same, for a cloud held by a shared pointer.  The cloud is not copied, and if tree is given (a search
+  * tree already built over all of cloud) it is used for the point searches instead of building another one.
+  * Only the tree over the heads is built.  For a cloud held by a non-const pointer, give PointT explicitly.
+  */
+template <typename PointT>
+void extractEuclideanClustersFast2(const boost::shared_ptr<const pcl::PointCloud<PointT> > &cloud, std::vector<std::vector<int> > &clusters,
+      double cluster_tol=.2, const ClusterLimits &limits=ClusterLimits(),
+      const typename pcl::KdTree<PointT>::Ptr &tree=typename pcl::KdTree<PointT>::Ptr(),
+      std::vector<ClusterStats> *clusterstats=NULL){
+   EuclideanClusterEngine<PointT,KdIndex<PointT>,GrabSeeds,ExactMerge> engine;
+   engine.index.prebuilt=tree;
+   ClusterVectorSink sink(clusters,clusterstats);
+   engine.cluster(cloud,sink,cluster_tol,limits);
 }
 
 
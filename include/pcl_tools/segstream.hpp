@@ -0,0 +1,488 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2010, Garratt Gallagher
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name Garratt Gallagher nor the names of other
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+
+#ifndef SEGSTREAM_HPP_
+#define SEGSTREAM_HPP_
+
+#include "pcl_tools/segfast.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b PcdStream reads the xyz coordinates out of a PCD file a chunk at a time, so a file far bigger than
+ * memory can be gone through in passes.  Handles ascii and binary data, with x, y and z stored as float or double.
+ * The other fields are skipped.
+ */
+class PcdStream{
+   std::ifstream file;
+   std::streampos datastart;
+   bool binary;
+   int pointbytes;       //binary: bytes per point
+   int offset[3],size[3]; //binary: byte offset and size (4 or 8) of x, y and z.  ascii: offset is the column
+   int numpoints,numread;
+   std::vector<char> buffer;
+   std::string line;
+
+public:
+   PcdStream(){ numpoints=numread=0; }
+
+   int numPoints() const { return numpoints; }
+
+   //read the header.  returns false if the file can't be read this way
+   bool open(const std::string &filename){
+      file.close();
+      file.clear();
+      file.open(filename.c_str(),std::ios::in|std::ios::binary);
+      if(!file.is_open()){
+         ROS_ERROR("PcdStream: failed to open %s",filename.c_str());
+         return false;
+      }
+      std::vector<std::string> fields,types;
+      std::vector<int> sizes,counts;
+      int width=0,height=1;
+      numpoints=-1;
+      std::string key;
+      while(std::getline(file,line)){
+         std::istringstream ss(line);
+         if(!(ss>>key) || key[0]=='#') continue;
+         std::string tok;
+         if(key=="FIELDS" || key=="COLUMNS"){ fields.clear(); while(ss>>tok) fields.push_back(tok); }
+         else if(key=="SIZE"){ sizes.clear(); int v; while(ss>>v) sizes.push_back(v); }
+         else if(key=="TYPE"){ types.clear(); while(ss>>tok) types.push_back(tok); }
+         else if(key=="COUNT"){ counts.clear(); int v; while(ss>>v) counts.push_back(v); }
+         else if(key=="WIDTH") ss>>width;
+         else if(key=="HEIGHT") ss>>height;
+         else if(key=="POINTS") ss>>numpoints;
+         else if(key=="DATA"){
+            ss>>tok;
+            if(tok!="ascii" && tok!="binary"){
+               ROS_ERROR("PcdStream: %s has DATA %s. only ascii and binary can be streamed",filename.c_str(),tok.c_str());
+               return false;
+            }
+            binary=(tok=="binary");
+            datastart=file.tellg();
+            break;
+         }
+      }
+      if(!fields.size() || (binary && sizes.size()!=fields.size())){
+         ROS_ERROR("PcdStream: could not make sense of the header of %s",filename.c_str());
+         return false;
+      }
+      if(numpoints<0) numpoints=width*height;
+      counts.resize(fields.size(),1);
+      types.resize(fields.size(),"F");
+      sizes.resize(fields.size(),4);
+      const char *xyz[3]={"x","y","z"};
+      for(int k=0;k<3;++k){
+         offset[k]=-1;
+         int at=0;
+         for(uint f=0;f<fields.size();++f){
+            if(fields[f]==xyz[k]){
+               offset[k]=at;
+               size[k]=sizes[f];
+               if(types[f]!="F" || (size[k]!=4 && size[k]!=8)){
+                  ROS_ERROR("PcdStream: %s stores %s as something other than float or double",filename.c_str(),xyz[k]);
+                  return false;
+               }
+            }
+            at+=(binary ? sizes[f] : 1)*counts[f];
+         }
+         if(offset[k]==-1){
+            ROS_ERROR("PcdStream: %s has no %s field",filename.c_str(),xyz[k]);
+            return false;
+         }
+      }
+      pointbytes=0;
+      for(uint f=0;f<fields.size();++f)
+         pointbytes+=sizes[f]*counts[f];
+      numread=0;
+      return true;
+   }
+
+   //go back to the first point
+   void rewind(){
+      file.clear();
+      file.seekg(datastart);
+      numread=0;
+   }
+
+   //read up to maxpoints more points into pts (which is cleared first).  returns how many were read, 0 at the end
+   int read(PointsSoA &pts, int maxpoints){
+      pts.clear();
+      int n=std::min(maxpoints,numpoints-numread);
+      if(n<=0) return 0;
+      pts.x.resize(n); pts.y.resize(n); pts.z.resize(n);
+      float *dest[3]={&pts.x[0],&pts.y[0],&pts.z[0]};
+      if(binary){
+         buffer.resize((size_t)n*pointbytes);
+         file.read(&buffer[0],buffer.size());
+         n=file.gcount()/pointbytes;
+         for(int i=0;i<n;++i){
+            const char *p=&buffer[(size_t)i*pointbytes];
+            for(int k=0;k<3;++k){
+               if(size[k]==4){ float v; memcpy(&v,p+offset[k],4); dest[k][i]=v; }
+               else{ double v; memcpy(&v,p+offset[k],8); dest[k][i]=v; }
+            }
+         }
+      }
+      else{
+         int lastcol=std::max(offset[0],std::max(offset[1],offset[2]));
+         int i=0;
+         for(;i<n && std::getline(file,line);++i){
+            const char *c=line.c_str();
+            char *end;
+            double v=0;
+            for(int col=0;col<=lastcol;++col){
+               if(v==v){ //once a line runs short, the rest of it is NaN
+                  v=strtod(c,&end);
+                  if(end==c) v=std::numeric_limits<double>::quiet_NaN();
+                  c=end;
+               }
+               for(int k=0;k<3;++k)
+                  if(offset[k]==col) dest[k][i]=v;
+            }
+         }
+         n=i;
+      }
+      pts.x.resize(n); pts.y.resize(n); pts.z.resize(n);
+      numread+=n;
+      return n;
+   }
+};
+
+
+//one point on its way through segfastStream: where it is, and its index in the file
+struct StreamPoint{
+   float x,y,z;
+   int index;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief Euclidean clustering of a PCD file too big to load.  The points are cut into slabs of about slabpoints
+  * points along the longest axis, and the slabs are clustered one at a time with segfast.  Only one slab is in memory
+  * at once, along with the band of points within cluster_tol of its lower border that were left over from the slabs
+  * before it.  The band is clustered with the slab, so any cluster reaching across the border picks up the labels on
+  * the other side, and the result is exactly what segfast would give on the whole cloud.
+  *
+  * The file is read three times (bounds, slab sizes, then splitting it into slab files), plus once more for each
+  * round of cutting up histogram bins too full to fit in a slab.  Each point's label is spilled to disk as soon as
+  * its slab is done.  What stays in memory besides the slab is a few ints per cluster.
+  * \param pcdfile the cloud, as an ascii or binary PCD file
+  * \param labelfile written with the label of each point in file order, as raw 32 bit ints.  -1 for points in
+  *        no cluster, or with non-finite coordinates.  The slab and label spill files go next to it while this runs
+  * \param cluster_tol the spatial cluster tolerance as a measure in L2 Euclidean space
+  * \param limits the sizes of cluster to keep, and how many of the largest. An int is taken as min_pts_per_cluster (default = 1)
+  * \param slabpoints about how many points to cluster at a time
+  * \param stats if given, the counts and phase times summed over the slabs. totaltime is the wall clock time of the whole call
+  * \return the number of clusters, or -1 if the files could not be read or written
+  */
+inline int segfastStream(const std::string &pcdfile, const std::string &labelfile, double cluster_tol=.2,
+      const ClusterLimits &limits=ClusterLimits(), int slabpoints=4000000, SegfastStats *stats=NULL){
+   timeval ttot=g_tick();
+   PcdStream reader;
+   if(!reader.open(pcdfile)) return -1;
+   PointsSoA chunk;
+   const int chunkpoints=1<<16;
+   float *coords[3];
+
+   //pass 1: the bounds, to pick the axis to cut along
+   double lo[3],hi[3];
+   for(int k=0;k<3;++k){ lo[k]=std::numeric_limits<double>::max(); hi[k]=-lo[k]; }
+   int numfinite=0;
+   while(reader.read(chunk,chunkpoints)){
+      coords[0]=&chunk.x[0]; coords[1]=&chunk.y[0]; coords[2]=&chunk.z[0];
+      for(int i=0;i<chunk.size();++i){
+         if(!pcl_isfinite(chunk.x[i]) || !pcl_isfinite(chunk.y[i]) || !pcl_isfinite(chunk.z[i])) continue;
+         numfinite++;
+         for(int k=0;k<3;++k){
+            lo[k]=std::min(lo[k],(double)coords[k][i]);
+            hi[k]=std::max(hi[k],(double)coords[k][i]);
+         }
+      }
+   }
+   int axis=0;
+   for(int k=1;k<3;++k)
+      if(hi[k]-lo[k] > hi[axis]-lo[axis]) axis=k;
+
+   //pass 2: a histogram along that axis, to place the borders so each slab gets about slabpoints points.  bin b
+   //holds edges[b] <= v < edges[b+1].  a bin with more than slabpoints points would make a slab at least that big
+   //wherever the borders go, so those bins are cut finer and the file counted again, until none are left
+   const int numbins=1<<16, numsplit=1<<10, maxrounds=4;
+   std::vector<double> edges(numbins+1),finer;
+   double binwidth=std::max(hi[axis]-lo[axis],1e-9)/numbins;
+   for(int b=0;b<numbins;++b) edges[b]=lo[axis]+b*binwidth;
+   edges[numbins]=std::numeric_limits<double>::max();
+   std::vector<int> hist;
+   for(int round=0;;++round){
+      hist.assign(edges.size()-1,0);
+      reader.rewind();
+      while(reader.read(chunk,chunkpoints)){
+         coords[0]=&chunk.x[0]; coords[1]=&chunk.y[0]; coords[2]=&chunk.z[0];
+         for(int i=0;i<chunk.size();++i){
+            if(!pcl_isfinite(chunk.x[i]) || !pcl_isfinite(chunk.y[i]) || !pcl_isfinite(chunk.z[i])) continue;
+            hist[std::upper_bound(edges.begin(),edges.end(),(double)coords[axis][i])-edges.begin()-1]++;
+         }
+      }
+      if(round==maxrounds) break;
+      //split the bins that are too full, unless they are already too narrow to tell floats apart
+      finer.clear();
+      for(uint b=0;b+1<edges.size();++b){
+         finer.push_back(edges[b]);
+         double top=(b+2==edges.size() ? hi[axis] : edges[b+1]);
+         if(hist[b]<=slabpoints || top-edges[b] <= std::max(fabs(edges[b]),fabs(top))*1e-6) continue;
+         for(int k=1;k<numsplit;++k)
+            finer.push_back(edges[b]+(top-edges[b])*k/numsplit);
+      }
+      finer.push_back(edges.back());
+      if(finer.size()==edges.size()) break;
+      edges.swap(finer);
+   }
+   std::vector<double> borders;  //slab s holds borders[s-1] <= v < borders[s]
+   int filled=0;
+   for(uint b=0;b<hist.size();++b){
+      if(hist[b]>slabpoints)
+         ROS_WARN("segfastStream: %d points are too close together along the cut to be split, so one slab gets them all",hist[b]);
+      if(filled>0 && filled+hist[b]>slabpoints){
+         borders.push_back(edges[b]);
+         filled=0;
+      }
+      filled+=hist[b];
+   }
+   int numslabs=borders.size()+1;
+
+   //pass 3: split the points into a file per slab
+   std::vector<std::string> slabnames(numslabs);
+   std::vector<FILE*> slabfiles(numslabs,(FILE*)NULL);
+   bool ok=true;
+   for(int s=0;s<numslabs;++s){
+      std::ostringstream name;
+      name<<labelfile<<".slab"<<s;
+      slabnames[s]=name.str();
+      slabfiles[s]=fopen(slabnames[s].c_str(),"wb");
+      if(!slabfiles[s]){
+         ROS_ERROR("segfastStream: could not write %s",slabnames[s].c_str());
+         ok=false;
+      }
+   }
+   std::vector<int> slabcount(numslabs,0);
+   reader.rewind();
+   for(int start=0;ok && reader.read(chunk,chunkpoints);start+=chunk.size()){
+      coords[0]=&chunk.x[0]; coords[1]=&chunk.y[0]; coords[2]=&chunk.z[0];
+      for(int i=0;i<chunk.size();++i){
+         if(!pcl_isfinite(chunk.x[i]) || !pcl_isfinite(chunk.y[i]) || !pcl_isfinite(chunk.z[i])) continue;
+         int s=std::upper_bound(borders.begin(),borders.end(),(double)coords[axis][i])-borders.begin();
+         StreamPoint sp={chunk.x[i],chunk.y[i],chunk.z[i],start+i};
+         if(fwrite(&sp,sizeof(sp),1,slabfiles[s])!=1){
+            ROS_ERROR("segfastStream: could not write %s",slabnames[s].c_str());
+            ok=false;
+            break;
+         }
+         slabcount[s]++;
+      }
+   }
+   //a write that was buffered can still fail when the file is closed
+   for(int s=0;s<numslabs;++s)
+      if(slabfiles[s] && fclose(slabfiles[s])!=0 && ok){
+         ROS_ERROR("segfastStream: could not write %s",slabnames[s].c_str());
+         ok=false;
+      }
+
+   //the labels are spilled into buckets by index, so they can be put back in file order a bucket at a time
+   int numpoints=reader.numPoints();
+   int bucketsize=std::max(slabpoints,1);
+   int numbuckets=std::max(1,(numpoints+bucketsize-1)/bucketsize);
+   std::vector<std::string> bucketnames(numbuckets);
+   std::vector<FILE*> bucketfiles(numbuckets,(FILE*)NULL);
+   for(int b=0;ok && b<numbuckets;++b){
+      std::ostringstream name;
+      name<<labelfile<<".labels"<<b;
+      bucketnames[b]=name.str();
+      bucketfiles[b]=fopen(bucketnames[b].c_str(),"wb");
+      if(!bucketfiles[b]){
+         ROS_ERROR("segfastStream: could not write %s",bucketnames[b].c_str());
+         ok=false;
+      }
+   }
+
+   //cluster the slabs in order.  a cluster gets a global label the first time it is seen, and global labels that
+   //turn out to be the same cluster are joined in sets.  count is the number of points put in each global label
+   SegfastStats st,slabstats;
+   st.clear();
+   DisjointSets sets;
+   sets.reset(0);
+   std::vector<int> count;
+   pcl::PointCloud<pcl::PointXYZ> cloud;
+   std::vector<int> inds,bandlabels,rep;
+   SegfastWorkspace<pcl::PointXYZ> workspace;
+   ClusterLabels flat;
+   for(int s=0;ok && s<numslabs;++s){
+      //the band carried over from the last slab comes first, then this slab's points
+      int numband=bandlabels.size();
+      cloud.points.resize(numband+slabcount[s]);
+      inds.resize(numband+slabcount[s]);
+      FILE *f=fopen(slabnames[s].c_str(),"rb");
+      if(!f){
+         ROS_ERROR("segfastStream: could not read back %s",slabnames[s].c_str());
+         ok=false;
+         break;
+      }
+      StreamPoint sp;
+      int got=numband;
+      for(;got<(int)cloud.points.size() && fread(&sp,sizeof(sp),1,f)==1;++got){
+         cloud.points[got].x=sp.x; cloud.points[got].y=sp.y; cloud.points[got].z=sp.z;
+         inds[got]=sp.index;
+      }
+      fclose(f);
+      if(got<(int)cloud.points.size()){
+         ROS_ERROR("segfastStream: could not read back %s",slabnames[s].c_str());
+         ok=false;
+         break;
+      }
+      remove(slabnames[s].c_str());
+      cloud.width=cloud.points.size();
+      cloud.height=1;
+      if(!cloud.points.size()) continue;
+
+      segfast(cloud,flat,workspace,cluster_tol,1,&slabstats);
+      st.downsampletime+=slabstats.downsampletime;
+      st.pairingtime+=slabstats.pairingtime;
+      st.indextime+=slabstats.indextime;
+      st.mergetime+=slabstats.mergetime;
+      st.searchcount+=slabstats.searchcount;
+      st.comparecount+=slabstats.comparecount;
+      st.mergecount+=slabstats.mergecount;
+      st.numheads+=slabstats.numheads;
+      st.numloners+=slabstats.numloners;
+
+      //the clusters holding band points carry on the labels from before, the rest get new ones
+      rep.assign(flat.size(),-1);
+      for(int i=0;i<numband;++i){
+         int &r=rep[flat.labels[i]];
+         if(r==-1) r=bandlabels[i];
+         else sets.join(r,bandlabels[i]);
+      }
+      for(int c=0;c<flat.size();++c)
+         if(rep[c]==-1){
+            rep[c]=sets.add();
+            count.push_back(0);
+         }
+      for(int i=numband;i<(int)cloud.points.size();++i){
+         int g=rep[flat.labels[i]];
+         count[g]++;
+         std::pair<int,int> rec(inds[i],g);
+         if(fwrite(&rec,sizeof(rec),1,bucketfiles[inds[i]/bucketsize])!=1){
+            ROS_ERROR("segfastStream: could not write %s",bucketnames[inds[i]/bucketsize].c_str());
+            ok=false;
+            break;
+         }
+      }
+
+      //keep whatever could still be within cluster_tol of the next slab
+      if(s+1<numslabs){
+         //the band rides along at the front of the next slab's cloud
+         double bandstart=borders[s]-cluster_tol;
+         int kept=0;
+         bandlabels.clear();
+         for(uint i=0;i<cloud.points.size();++i){
+            const pcl::PointXYZ &p=cloud.points[i];
+            if((axis==0 ? p.x : axis==1 ? p.y : p.z) < bandstart) continue;
+            cloud.points[kept++]=p;
+            bandlabels.push_back(rep[flat.labels[i]]);
+         }
+         cloud.points.resize(kept);
+      }
+   }
+   for(int b=0;b<numbuckets;++b)
+      if(bucketfiles[b] && fclose(bucketfiles[b])!=0 && ok){
+         ROS_ERROR("segfastStream: could not write %s",bucketnames[b].c_str());
+         ok=false;
+      }
+   for(int s=0;s<numslabs;++s)
+      remove(slabnames[s].c_str());
+
+   //total up each cluster and apply the limits.  count becomes the final label of each global label
+   int numclusters=0;
+   if(ok){
+      std::vector<int> sizes(count.size(),0),ranked;
+      for(uint g=0;g<count.size();++g)
+         sizes[sets.find(g)]+=count[g];
+      limits.pick(sizes,ranked);
+      for(uint g=0;g<sizes.size();++g)
+         if(sizes[g]!=-1) sizes[g]=numclusters++;
+      for(uint g=0;g<count.size();++g)
+         count[g]=sizes[sets.find(g)];
+   }
+
+   //put the labels back in file order, a bucket at a time
+   FILE *out=(ok ? fopen(labelfile.c_str(),"wb") : NULL);
+   if(ok && !out){
+      ROS_ERROR("segfastStream: could not write %s",labelfile.c_str());
+      ok=false;
+   }
+   std::vector<int> &labels=inds;
+   for(int b=0;b<numbuckets;++b){
+      if(ok){
+         int start=b*bucketsize;
+         labels.assign(std::min(bucketsize,numpoints-start),-1);
+         FILE *f=fopen(bucketnames[b].c_str(),"rb");
+         std::pair<int,int> rec;
+         while(f && fread(&rec,sizeof(rec),1,f)==1)
+            labels[rec.first-start]=count[rec.second];
+         if(f) fclose(f);
+         if(labels.size() && fwrite(&labels[0],sizeof(int),labels.size(),out)!=labels.size()){
+            ROS_ERROR("segfastStream: could not write %s",labelfile.c_str());
+            ok=false;
+         }
+      }
+      remove(bucketnames[b].c_str());
+   }
+   if(out && fclose(out)!=0 && ok){
+      ROS_ERROR("segfastStream: could not write %s",labelfile.c_str());
+      ok=false;
+   }
+
+   st.numpoints=numpoints;
+   st.numclusters=numclusters;
+   st.totaltime=g_tock(ttot);
+   if(stats) *stats=st;
+   return ok ? numclusters : -1;
+}
+
+
+#endif /* SEGSTREAM_HPP_ */
@@ -0,0 +1,431 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2010, Garratt Gallagher
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name Garratt Gallagher nor the names of other
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+
+#ifndef SPATIALHASH_HPP_
+#define SPATIALHASH_HPP_
+
+#include "pcl/point_types.h"
+#include "pcl/point_cloud.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b HashGrid buckets a set of points into cubic cells.  The cells are kept in one contiguous array
+ * (points sorted by cell, with a start offset per cell) and found through an open addressing hash on the cell
+ * coordinates, so only occupied cells cost anything.  Used by SpatialHash, which is what everyone else should use.
+ * \author Garratt Gallagher
+ */
+struct HashGrid{
+   double cellsize;
+   float origin[3];
+   std::vector<long long> tablekeys; //hash table: packed cell coordinates
+   std::vector<int> tablecells;      //hash table: the cell with that key, -1 if the slot is empty
+   std::vector<long long> cellkeys;  //the packed coordinates of each cell
+   std::vector<int> cellstart;       //points in cell c are entries cellstart[c] to cellstart[c+1]-1
+   std::vector<int> entries;         //the id handed back for each entry (a cloud index, or a position in the subset)
+   std::vector<float> xyz;           //coordinates of each entry, stored alongside so searches don't touch the cloud
+   std::vector<int> tempcell;        //scratch: cell of each input point
+
+   HashGrid(){ cellsize=0; }
+
+   bool built(){ return cellsize>0; }
+
+   //forget the points, but keep the buffers so the next build does not allocate
+   void clear(){ cellsize=0; }
+
+   //each cell coordinate gets 21 bits of the key, so a grid can only span about 2^21 cells along an axis before
+   //keys wrap around into each other.  build() keeps every cell within maxcoord of the origin, which leaves room
+   //for the neighbor lookups around the outermost cells
+   static const int maxcoord=(1<<20)-16;
+
+   static long long packKey(int ix, int iy, int iz){
+      return (((long long)(ix+(1<<20)))<<42) | (((long long)(iy+(1<<20)))<<21) | (long long)(iz+(1<<20));
+   }
+
+   static void unpackKey(long long key, int &ix, int &iy, int &iz){
+      ix=(int)(key>>42)-(1<<20);
+      iy=(int)((key>>21)&((1<<21)-1))-(1<<20);
+      iz=(int)(key&((1<<21)-1))-(1<<20);
+   }
+
+   //the cell holding coordinate v.  anything past maxcoord is clamped to just beyond it, where there are no points
+   inline int cellCoord(float v, int axis){
+      double c=floor((v-origin[axis])/cellsize);
+      return (int)std::max(-maxcoord-1.0,std::min(maxcoord+1.0,c));
+   }
+
+   inline unsigned int slotOf(long long key){
+      unsigned long long h=(unsigned long long)key*0x9E3779B97F4A7C15ULL;
+      return (unsigned int)(h>>32) & (tablekeys.size()-1);
+   }
+
+   //returns the cell with this key, or -1 if it is empty
+   inline int findCell(long long key){
+      unsigned int slot=slotOf(key);
+      while(tablecells[slot]!=-1){
+         if(tablekeys[slot]==key) return tablecells[slot];
+         slot=(slot+1)&(tablekeys.size()-1);
+      }
+      return -1;
+   }
+
+   //bucket the points.  if inds is given only those points are used, and searches return positions in inds.
+   //the cells are laid out from the lowest corner of the points, or from fixedorigin if it is given, which keeps
+   //the cell keys of two grids with the same cell size comparable.  returns false, and leaves the grid unbuilt,
+   //if the points reach further than maxcoord cells from the origin along some axis
+   template <typename PointT>
+   bool build(const pcl::PointCloud<PointT> &cloud, const std::vector<int> *inds, double _cellsize, const float *fixedorigin=NULL){
+      cellsize=0;
+      int n=(inds ? inds->size() : cloud.points.size());
+      bool first=true;
+      float lo[3]={0,0,0},hi[3]={0,0,0};
+      for(int i=0;i<n;++i){
+         const PointT &p=cloud.points[inds ? (*inds)[i] : i];
+         if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)) continue;
+         float v[3]={p.x,p.y,p.z};
+         for(int k=0;k<3;++k){
+            if(first || v[k]<lo[k]) lo[k]=v[k];
+            if(first || v[k]>hi[k]) hi[k]=v[k];
+         }
+         first=false;
+      }
+      if(fixedorigin) std::copy(fixedorigin,fixedorigin+3,origin);
+      else std::copy(lo,lo+3,origin);
+      for(int k=0;k<3;++k)
+         if((lo[k]-origin[k])/_cellsize < -maxcoord || (hi[k]-origin[k])/_cellsize > maxcoord)
+            return false;
+      cellsize=_cellsize;
+      unsigned int tablesize=16;
+      while(tablesize < 2*(unsigned int)n) tablesize*=2;
+      tablekeys.resize(tablesize);
+      tablecells.assign(tablesize,-1);
+      cellkeys.clear();
+      cellstart.clear();
+      tempcell.resize(n);
+
+      //first pass: find each point's cell and count the points in each cell
+      for(int i=0;i<n;++i){
+         const PointT &p=cloud.points[inds ? (*inds)[i] : i];
+         if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)){
+            tempcell[i]=-1;
+            continue;
+         }
+         long long key=packKey(cellCoord(p.x,0),cellCoord(p.y,1),cellCoord(p.z,2));
+         unsigned int slot=slotOf(key);
+         while(tablecells[slot]!=-1 && tablekeys[slot]!=key)
+            slot=(slot+1)&(tablesize-1);
+         if(tablecells[slot]==-1){
+            tablekeys[slot]=key;
+            tablecells[slot]=cellkeys.size();
+            cellkeys.push_back(key);
+            cellstart.push_back(0);
+         }
+         tempcell[i]=tablecells[slot];
+         cellstart[tempcell[i]]++;
+      }
+      //turn the counts into offsets
+      int total=0;
+      for(unsigned int c=0;c<cellstart.size();++c){
+         int count=cellstart[c];
+         cellstart[c]=total;
+         total+=count;
+      }
+      cellstart.push_back(total);
+
+      //second pass: drop the points into their cells
+      entries.resize(total);
+      xyz.resize(3*total);
+      for(int i=0;i<n;++i){
+         if(tempcell[i]==-1) continue;
+         int e=cellstart[tempcell[i]]++;
+         const PointT &p=cloud.points[inds ? (*inds)[i] : i];
+         entries[e]=i;
+         xyz[3*e]=p.x; xyz[3*e+1]=p.y; xyz[3*e+2]=p.z;
+      }
+      //the second pass pushed each start up to the next cell's start, so shift them back
+      for(int c=cellstart.size()-1;c>0;--c)
+         cellstart[c]=cellstart[c-1];
+      cellstart[0]=0;
+      return true;
+   }
+
+   //check every entry in cell c against pt
+   inline void searchCell(int c, float x, float y, float z, float r2, std::vector<int> &indices, std::vector<float> *dists){
+      for(int e=cellstart[c];e<cellstart[c+1];++e){
+         float dx=xyz[3*e]-x, dy=xyz[3*e+1]-y, dz=xyz[3*e+2]-z;
+         float d=dx*dx+dy*dy+dz*dz;
+         if(d<=r2){
+            indices.push_back(entries[e]);
+            if(dists) dists->push_back(d);
+         }
+      }
+   }
+
+   //append all the entries within radius of (x,y,z)
+   void search(float x, float y, float z, double radius, std::vector<int> &indices, std::vector<float> *dists){
+      if(!pcl_isfinite(x) || !pcl_isfinite(y) || !pcl_isfinite(z)) return;
+      float r2=radius*radius;
+      int lo[3]={cellCoord(x-radius,0),cellCoord(y-radius,1),cellCoord(z-radius,2)};
+      int hi[3]={cellCoord(x+radius,0),cellCoord(y+radius,1),cellCoord(z+radius,2)};
+      double span=(double)(hi[0]-lo[0]+1)*(hi[1]-lo[1]+1)*(hi[2]-lo[2]+1);
+      if(span > cellkeys.size()){
+         //the search covers more cells than are occupied: just walk the occupied ones
+         for(unsigned int c=0;c<cellkeys.size();++c)
+            searchCell(c,x,y,z,r2,indices,dists);
+         return;
+      }
+      for(int ix=lo[0];ix<=hi[0];++ix)
+         for(int iy=lo[1];iy<=hi[1];++iy)
+            for(int iz=lo[2];iz<=hi[2];++iz){
+               int c=findCell(packKey(ix,iy,iz));
+               if(c!=-1) searchCell(c,x,y,z,r2,indices,dists);
+            }
+   }
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/** \brief @b SpatialHash answers radius searches on a cloud, replacing the SplitCloud2 / NNN searches from the nnn package.
+ * Call useInds() to also search a subset of the cloud, in which case NNN(...,true) returns positions in that subset.
+ * Each grid is built the first time it is searched.  Its cell size is the radius given to the constructor, or
+ * if that is 0, the radius of that first search.
+ * \author Garratt Gallagher
+ */
+template <typename PointT>
+class SpatialHash{
+   const pcl::PointCloud<PointT> *_cloud;
+   double _cellsize;
+   HashGrid full,subset;
+   std::vector<int> subinds;
+   std::vector<std::pair<float,int> > sortbuf;
+   std::vector<int> tempinds,order,hitquery,fill;
+   std::vector<long long> qkeys;
+
+   HashGrid &getGrid(bool usesubset, double radius){
+      HashGrid &grid=(usesubset ? subset : full);
+      //a cloud too wide for cells this small gets bigger ones: the searches check every distance, so they
+      //come out the same, just with more points to check per cell
+      double cellsize=(_cellsize>0 ? _cellsize : radius);
+      while(!grid.built() && !grid.build(*_cloud,usesubset ? &subinds : NULL,cellsize))
+         cellsize*=2;
+      return grid;
+   }
+
+public:
+   SpatialHash(){ _cloud=NULL; _cellsize=0; }
+
+   SpatialHash(const pcl::PointCloud<PointT> &cloud, double cellsize=0){
+      setInputCloud(cloud,cellsize);
+   }
+
+   //point the index at a new cloud.  The grids are rebuilt lazily as before, but into the buffers
+   //left over from the last cloud, so an index kept around between frames stops allocating once it has warmed up
+   void setInputCloud(const pcl::PointCloud<PointT> &cloud, double cellsize=0){
+      _cloud=&cloud;
+      _cellsize=cellsize;
+      full.clear();
+      subset.clear();
+      subinds.clear();
+   }
+
+   //search a subset of the cloud when NNN is called with usesubset=true
+   void useInds(const std::vector<int> &inds){
+      subinds=inds;
+      subset.clear();
+   }
+
+   //find the points within radius of pt
+   void NNN(const PointT &pt, std::vector<int> &indices, double radius, bool usesubset=false){
+      indices.clear();
+      getGrid(usesubset,radius).search(pt.x,pt.y,pt.z,radius,indices,NULL);
+   }
+
+   //find the points within radius of pt, and their squared distances
+   void NNN(const PointT &pt, std::vector<int> &indices, std::vector<float> &dists, double radius, bool usesubset=false){
+      indices.clear();
+      dists.clear();
+      getGrid(usesubset,radius).search(pt.x,pt.y,pt.z,radius,indices,&dists);
+   }
+
+   //same as NNN, but the results are sorted by squared distance, closest first
+   void NNNSorted(const PointT &pt, std::vector<int> &indices, std::vector<float> &dists, double radius, bool usesubset=false){
+      NNN(pt,indices,dists,radius,usesubset);
+      sortbuf.resize(indices.size());
+      for(uint i=0;i<indices.size();++i)
+         sortbuf[i]=std::make_pair(dists[i],indices[i]);
+      std::sort(sortbuf.begin(),sortbuf.end());
+      for(uint i=0;i<indices.size();++i){
+         dists[i]=sortbuf[i].first;
+         indices[i]=sortbuf[i].second;
+      }
+   }
+
+   //run a radius search around each of the cloud points in queries.  the results for queries[q] are
+   //indices[offsets[q]] to indices[offsets[q+1]-1].  Queries that share a cell are searched back to back.
+   void NNN(const std::vector<int> &queries, std::vector<int> &offsets, std::vector<int> &indices, double radius, bool usesubset=false){
+      HashGrid &grid=getGrid(usesubset,radius);
+      order.resize(queries.size());
+      qkeys.resize(queries.size());
+      for(uint q=0;q<queries.size();++q){
+         const PointT &p=_cloud->points[queries[q]];
+         qkeys[q]=HashGrid::packKey(grid.cellCoord(p.x,0),grid.cellCoord(p.y,1),grid.cellCoord(p.z,2));
+         order[q]=q;
+      }
+      std::sort(order.begin(),order.end(),KeyLess(qkeys));
+      //search in cell order, remembering which query each hit came from
+      tempinds.clear();
+      hitquery.clear();
+      for(uint k=0;k<order.size();++k){
+         const PointT &p=_cloud->points[queries[order[k]]];
+         grid.search(p.x,p.y,p.z,radius,tempinds,NULL);
+         hitquery.resize(tempinds.size(),order[k]);
+      }
+      //then lay the hits out in query order
+      offsets.assign(queries.size()+1,0);
+      for(uint h=0;h<hitquery.size();++h)
+         offsets[hitquery[h]+1]++;
+      for(uint q=0;q<queries.size();++q)
+         offsets[q+1]+=offsets[q];
+      indices.resize(tempinds.size());
+      fill.assign(offsets.begin(),offsets.end()-1);
+      for(uint h=0;h<hitquery.size();++h)
+         indices[fill[hitquery[h]]++]=tempinds[h];
+   }
+
+private:
+   struct KeyLess{
+      const std::vector<long long> &keys;
+      KeyLess(const std::vector<long long> &k):keys(k){}
+      bool operator()(int a, int b) const { return keys[a]<keys[b]; }
+   };
+};
+
+
+//one-off radius searches, for when there is no SpatialHash around.  these just walk the whole cloud,
+//so anything that searches the same cloud more than a few times should build a SpatialHash instead
+template <typename PointT>
+void NNN(const pcl::PointCloud<PointT> &cloud, const PointT &pt, std::vector<int> &indices, std::vector<float> &dists, double radius){
+   indices.clear();
+   dists.clear();
+   float r2=radius*radius;
+   for(uint i=0;i<cloud.points.size();++i){
+      float dx=cloud.points[i].x-pt.x, dy=cloud.points[i].y-pt.y, dz=cloud.points[i].z-pt.z;
+      float d=dx*dx+dy*dy+dz*dz;
+      if(d<=r2){
+         indices.push_back(i);
+         dists.push_back(d);
+      }
+   }
+}
+
+template <typename PointT>
+void NNN(const pcl::PointCloud<PointT> &cloud, const PointT &pt, std::vector<int> &indices, double radius){
+   std::vector<float> dists;
+   NNN(cloud,pt,indices,dists,radius);
+}
+
+
+
+//spread the low 21 bits of v out to every third bit
+inline unsigned long long mortonSpread(unsigned int v){
+   unsigned long long x=v & 0x1fffff;
+   x=(x | x<<32) & 0x1f00000000ffffULL;
+   x=(x | x<<16) & 0x1f0000ff0000ffULL;
+   x=(x | x<<8)  & 0x100f00f00f00f00fULL;
+   x=(x | x<<4)  & 0x10c30c30c30c30c3ULL;
+   x=(x | x<<2)  & 0x1249249249249249ULL;
+   return x;
+}
+
+/** \brief find the order that puts the points of cloud into Z (Morton) order of the cellsize voxels they fall in,
+ * so points that are close in space end up close in memory.  order[k] is the cloud index of the k'th point.
+ * Non-finite points go at the end.  keys is scratch space, pass the same one in to avoid reallocating.
+ */
+template <typename PointT>
+void mortonOrder(const pcl::PointCloud<PointT> &cloud, double cellsize, std::vector<int> &order,
+      std::vector<std::pair<unsigned long long,int> > &keys){
+   int n=cloud.points.size();
+   float minpt[3]={0,0,0};
+   bool first=true;
+   for(int i=0;i<n;++i){
+      const PointT &p=cloud.points[i];
+      if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)) continue;
+      if(first || p.x<minpt[0]) minpt[0]=p.x;
+      if(first || p.y<minpt[1]) minpt[1]=p.y;
+      if(first || p.z<minpt[2]) minpt[2]=p.z;
+      first=false;
+   }
+   keys.resize(n);
+   for(int i=0;i<n;++i){
+      const PointT &p=cloud.points[i];
+      if(!pcl_isfinite(p.x) || !pcl_isfinite(p.y) || !pcl_isfinite(p.z)){
+         keys[i]=std::make_pair(~0ULL,i);
+         continue;
+      }
+      float v[3]={p.x,p.y,p.z};
+      unsigned int c[3];
+      for(int k=0;k<3;++k){
+         double cell=floor((v[k]-minpt[k])/cellsize);
+         c[k]=(cell > 0x1fffff ? 0x1fffff : (unsigned int)cell);
+      }
+      keys[i]=std::make_pair(mortonSpread(c[0]) | mortonSpread(c[1])<<1 | mortonSpread(c[2])<<2, i);
+   }
+   std::sort(keys.begin(),keys.end());
+   order.resize(n);
+   for(int i=0;i<n;++i)
+      order[i]=keys[i].second;
+}
+
+template <typename PointT>
+void mortonOrder(const pcl::PointCloud<PointT> &cloud, double cellsize, std::vector<int> &order){
+   std::vector<std::pair<unsigned long long,int> > keys;
+   mortonOrder(cloud,cellsize,order,keys);
+}
+
+//out.points[k]=cloud.points[order[k]]
+template <typename PointT>
+void reorderCloud(const pcl::PointCloud<PointT> &cloud, const std::vector<int> &order, pcl::PointCloud<PointT> &out){
+   out.header=cloud.header;
+   out.points.resize(order.size());
+   for(uint k=0;k<order.size();++k)
+      out.points[k]=cloud.points[order[k]];
+   out.width=out.points.size();
+   out.height=1;
+   out.is_dense=cloud.is_dense;
+}
+
+#endif /* SPATIALHASH_HPP_ */
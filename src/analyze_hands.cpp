@@ -44,7 +44,7 @@
 #include <body_msgs/Hands.h>
 #include <sensor_msgs/point_cloud_conversion.h>
 #include <pcl_tools/pcl_utils.h>
-#include <nnn/nnn.hpp>
+#include <pcl_tools/spatialhash.hpp>
 #include <pcl_tools/segfast.hpp>
 
 
@@ -113,11 +113,22 @@ public:
    Eigen::Vector4f centroid, direction;
    Finger(pcl::PointCloud<pcl::PointXYZ> &cluster, Eigen::Vector4f &palmcenter){
       cloud=cluster;
-      EIGEN_ALIGN16 Eigen::Vector3f eigen_values;
-      EIGEN_ALIGN16 Eigen::Matrix3f eigen_vectors;
       Eigen::Matrix3f cov;
       pcl::compute3DCentroid (cluster, centroid);
       pcl::computeCovarianceMatrixNormalized(cluster,centroid,cov);
+      setDirection(cov,palmcenter);
+   }
+
+   //build the finger straight from the stats the clustering gathered, without copying out its points (cloud is left empty)
+   Finger(const ClusterStats &stats, Eigen::Vector4f &palmcenter){
+      centroid=stats.centroid();
+      setDirection(stats.covariance(),palmcenter);
+   }
+
+   //the finger points along the largest eigenvector of its covariance, away from the palm
+   void setDirection(const Eigen::Matrix3f &cov, Eigen::Vector4f &palmcenter){
+      EIGEN_ALIGN16 Eigen::Vector3f eigen_values;
+      EIGEN_ALIGN16 Eigen::Matrix3f eigen_vectors;
       pcl::eigen33 (cov, eigen_vectors, eigen_values);
       direction(0)=eigen_vectors (0, 2);
       direction(1)=eigen_vectors (1, 2);
@@ -206,7 +217,7 @@ public:
       std::vector<int> searchinds;
 
 
-       SplitCloud2<pcl::PointXYZ> sc2(full,tol);
+       SpatialHash<pcl::PointXYZ> sc2(full,tol);
        inds2.resize(full.points.size(),-1);
        t1=g_tock(t0);t0=g_tick();
        int label;
@@ -289,13 +300,13 @@ public:
       if(digits.size()==0)
          return;
       std::vector< std::vector<int> > indclusts;
-       extractEuclideanClustersFast2(digits,indclusts,clustertol,mincluster);
+      std::vector<ClusterStats> clusterstats;
+       //at most five fingers and the wrist are of any use, so only the six biggest blobs are kept
+       extractEuclideanClustersFast2(digits,indclusts,clustertol,ClusterLimits(mincluster,std::numeric_limits<int>::max(),6),false,&clusterstats);
 //       cout<<" clusters: "<<indclusts.size()<<endl;
        if(!indclusts.size()) return;
-       pcl::PointCloud<pcl::PointXYZ> cluster;
        for(uint i=0;i<indclusts.size();++i){
-             getSubCloud(digits,indclusts[i], cluster,true);
-             fingers.push_back(Finger(cluster,centroid));
+             fingers.push_back(Finger(clusterstats[i],centroid));
              //if it is actually the wrist, it is easily identified because the largest eigenvalue is perpendicular to the vector from the wrist
              //also, because we flip the 'normal' already, we are guaranteed this is positive:
 //             if((fingers.back().centroid-centroid).dot(fingers.back().direction)/(fingers.back().centroid-centroid).norm() < .5 ){//a very conservative value...
@@ -44,7 +44,7 @@
 #include <body_msgs/Hands.h>
 #include <sensor_msgs/point_cloud_conversion.h>
 #include <pcl_tools/pcl_utils.h>
-#include <nnn/nnn.hpp>
+#include <pcl_tools/spatialhash.hpp>
 #include <pcl_tools/segfast.hpp>
 
 
@@ -141,9 +141,10 @@ pcl::PointXYZ eigenToPclPoint(Eigen::Vector4f v){
 //find the points that are ajoining a cloud, but not in it:
 //cloud: the full cloud
 //cloudpts a vector of indices into cloud that represents the cluster for which we want to find near points
+//index: radius searches over cloud
 //centroid: the centroid of the nearby pts
 //return: true if points were found within 5cm
-bool findNearbyPts(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<int> &cloudpts, Eigen::Vector4f &centroid){
+bool findNearbyPts(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<int> &cloudpts, SpatialHash<pcl::PointXYZ> &index, Eigen::Vector4f &centroid){
    std::vector<int> inds(cloud.size(),1); //a way of marking the points we have looked at
    // 1: not in the cluster  0: in the cluster, seen  -1: in the cluster, not seen
    std::vector<int> nearpts; //a way of marking the points we have looked at
@@ -151,7 +152,7 @@ bool findNearbyPts(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<int> &clou
    for(uint i=0;i<cloudpts.size(); ++i) inds[cloudpts[i]]=-1;
    for(uint i=0;i<cloudpts.size(); ++i){
       if(inds[cloudpts[i]]==-1){
-         NNN(cloud,cloud.points[cloudpts[i]],temp, .05);
+         index.NNN(cloud.points[cloudpts[i]],temp, .05);
                mapping_msgs::PolygonalMap pmap;
                geometry_msgs::Polygon p;
          for(uint j=0;j<temp.size(); ++j){
@@ -184,12 +185,15 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
    Eigen::Vector4f centroid1,centroid2,nearcent1;
 //   bool foundarm=false;
 
+   //all the searches below are on the same cloud, so bucket it once
+   SpatialHash<pcl::PointXYZ> index(cloud,.1);
+
    //for debugging delays:
    TimeEvaluator te("getNearBlobs2: ");
 //----------FIND FIRST HAND--------------------------
 
    //find closest pt to camera:
-   NNN(cloud,pt,inds1,dists, 1.0);
+   index.NNN(pt,inds1,dists, 1.0);
    int ind=0; double smallestdist;
    for(uint i=0;i<dists.size(); ++i){
       if(dists[i]<smallestdist || i==0 ){
@@ -203,7 +207,7 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
    te.mark("closest pt");
 
    //find points near that the closest point
-   NNN(cloud,pt1,inds2, .1);
+   index.NNN(pt1,inds2, .1);
 
    //if there is nothing near that point, we're probably seeing noise.  just give up
    if(inds2.size() < 100){
@@ -219,13 +223,13 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
 
    pcl::compute3DCentroid(cloud,inds2,centroid1);
    pt2.x=centroid1(0); pt2.y=centroid1(1)-.02; pt2.z=centroid1(2);
-   NNN(cloud,pt2,inds2, .1);
+   index.NNN(pt2,inds2, .1);
 
    //in the middle of everything, locate where the arms is:
    std::vector<int> temp;
-   NNN(cloud,pt2,temp, .15);
+   index.NNN(pt2,temp, .15);
    //finding the arms is really reliable. we'll just throw out anytime when we can't find it.
-   if(!findNearbyPts(cloud,temp,nearcent1))
+   if(!findNearbyPts(cloud,temp,index,nearcent1))
       return false;
 
 
@@ -233,7 +237,7 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
 
    pcl::compute3DCentroid(cloud,inds2,centroid1);
    pt2.x=centroid1(0); pt2.y=centroid1(1)-.01; pt2.z=centroid1(2);
-   NNN(cloud,pt2,inds2, .1);
+   index.NNN(pt2,inds2, .1);
 
    //save this cluster as a separate cloud.
    getSubCloud(cloud,inds2,cloudout);
@@ -249,7 +253,7 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
    int s1,s2=0;
    s1=inds2.size();
    //search for all points in the cloud that are as close as the center of the potential hand:
-   NNN(cloud,pt,inds2, centroid1.norm());
+   index.NNN(pt,inds2, centroid1.norm());
    for(uint i=0;i<inds2.size(); ++i){
       if(inds3[inds2[i]]) ++s2;
    }
@@ -290,13 +294,13 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
    if(foundpt){
 //	   cout<<" 2nd run: "<<thresh-smallestdist;
 	   pcl::PointCloud<pcl::PointXYZ> cloudout2;
-	   NNN(cloud,cloud.points[ind],inds2, .1);
+	   index.NNN(cloud.points[ind],inds2, .1);
 	   pcl::compute3DCentroid(cloud,inds2,centroid2);
 	   pt2.x=centroid2(0); pt2.y=centroid2(1)-.02; pt2.z=centroid2(2);
-	   NNN(cloud,pt2,inds2, .1);
+	   index.NNN(pt2,inds2, .1);
 	   pcl::compute3DCentroid(cloud,inds2,centroid2);
 	   pt2.x=centroid2(0); pt2.y=centroid2(1)-.01; pt2.z=centroid2(2);
-	   NNN(cloud,pt2,inds2, .1);
+	   index.NNN(pt2,inds2, .1);
 
 	   //if too few points in the second hand, discard
 	   if(inds2.size()<100) return true;
@@ -307,9 +311,9 @@ bool getNearBlobs2(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::Point
 		   if(inds3[inds2[i]]==0)
 		      return true;
 
-	   NNN(cloud,pt2,temp, .15);
+	   index.NNN(pt2,temp, .15);
 	   //finding the arms is really reliable. we'll just throw out anytime when we can't find it.
-	   if(!findNearbyPts(cloud,temp,nearcent1))
+	   if(!findNearbyPts(cloud,temp,index,nearcent1))
 	      return true;
 
 	   getSubCloud(cloud,inds2,cloudout2);
@@ -50,7 +50,7 @@
 //#include <mapping_msgs/PolygonalMap.h>
 //#include <body_msgs/Hands.h>
 //#include <pcl_tools/pcl_utils.h>
-//#include <nnn/nnn.hpp>
+#include <pcl_tools/spatialhash.hpp>
 //#include <pcl_tools/segfast.hpp>
 
 
@@ -239,8 +239,9 @@ void getHandCloud(body_msgs::Hand &hand, sensor_msgs::PointCloud2 &fullcloud){
 
 
    printf("got hand %.02f, %02f, %02f ",handpos.x, handpos.y,handpos.z);
+   SpatialHash<pcl::PointXYZ> index(cloudin,.1);
    //find points near the skeletal hand position
-   NNN(cloudin,handpos,inds, .1);
+   index.NNN(handpos,inds, .1);
 
    //Iterate the following:
    //    find centroid of current cluster
@@ -250,7 +251,7 @@ void getHandCloud(body_msgs::Hand &hand, sensor_msgs::PointCloud2 &fullcloud){
    for(int i=0; i<3;i++){
       pcl::compute3DCentroid(cloudin,inds,handcentroid);
       handpos=addVector(handcentroid,hand.arm,hand.palm.translation,.05);
-      NNN(cloudin,handpos,inds, .1);
+      index.NNN(handpos,inds, .1);
    }
 
    //save this cluster as a separate cloud.
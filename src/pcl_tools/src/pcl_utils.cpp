@@ -35,7 +35,10 @@
 
 
 #include "pcl_tools/pcl_utils.h"
+#include "pcl_tools/segfast.hpp"
 
+#ifndef GTICK
+#define GTICK
   timeval g_tick(){
      struct timeval tv;
      gettimeofday(&tv, NULL);
@@ -48,6 +51,7 @@
      gettimeofday(&tv, NULL);
      return (double)(tv.tv_sec-tprev.tv_sec) + (tv.tv_usec-tprev.tv_usec)/1000000.0;
   }
+#endif
 
   int getUsec(){
      struct timeval tv;
@@ -98,64 +102,168 @@
 
 //include template versions, but we'll compile in non-templated versions
 
-//A helper function for ICP:
-//ref should map to target, but not necessarily the other way 'round.  also, target should not be downsampled
+//moves the cloud for ICP.  clouds with normals get them rotated too
 template <typename PointT>
-int getClosestPoints(pcl::PointCloud<PointT> &ref_cloud, pcl::PointCloud<PointT> &target_cloud, std::vector<int> &ref_pts, std::vector<int> &tgt_pts, double dist_thresh=.2, uint num_pts=500){
-   timeval t0=g_tick();
-   pcl::KdTreeFLANN<PointT> ttree;
-   ttree.setInputCloud(target_cloud.makeShared());
-//   ROS_INFO("step 1: initialization  %f secs. ",g_tock(t0));
-   t0=g_tick();
-   srand(getUsec());
+void icpTransform(pcl::PointCloud<PointT> &cloud, const Eigen::Matrix4f &trans){
+   transformPointCloud(cloud,cloud,trans);
+}
+void icpTransform(pcl::PointCloud<pcl::PointXYZINormal> &cloud, const Eigen::Matrix4f &trans){
+   transformPointCloudWithNormals(cloud,cloud,trans);
+}
+
+template <typename PointT>
+void Icp2D<PointT>::setTarget(const pcl::PointCloud<PointT> &target){
+   setTarget(typename pcl::PointCloud<PointT>::ConstPtr(target.makeShared()));
+}
+
+template <typename PointT>
+void Icp2D<PointT>::setTarget(const typename pcl::PointCloud<PointT>::ConstPtr &target){
+   target_=target;
+   tree_.setInputCloud(target_);
+   targetversion_++;  //the workers' trees catch up on their next batch
+   searched_=0;
+}
+
+template <typename PointT>
+void Icp2D<PointT>::matchRange(pcl::KdTreeFLANN<PointT> &tree, const pcl::PointCloud<PointT> *ref_cloud, int begin, int end, double dist_thresh){
    std::vector<int> indices(1);
    std::vector<float> dists(1);
-   ref_pts.clear();
-   tgt_pts.clear();
-   int ind;
+   for(int k=begin;k<end;k++){
+      const PointT &pt=ref_cloud->points[candidates_[k]];
+      matches_[k]=-1;
+      if(tree.nearestKSearch(pt,1,indices,dists) && dists[0] < dist_thresh)
+         if(fabs(pt.z - target_->points[indices[0]].z) < dist_thresh/10.0 )
+            matches_[k]=indices[0];
+   }
+}
 
-   std::vector<int> notused(ref_cloud.points.size(),1);
-   for(uint i=0;i<ref_cloud.points.size();i++)
-      notused[i]=i;
-   long tcount=0;
-   int indsleft=ref_cloud.points.size();
-   while(ref_pts.size() < num_pts && indsleft > 10){
-      ind=rand() %indsleft;
-      if(ttree.nearestKSearch(ref_cloud.points[notused[ind]],1,indices,dists) && dists[0] < dist_thresh)
-            if(fabs(ref_cloud.points[notused[ind]].z - target_cloud.points[indices[0]].z) < dist_thresh/10.0 ){
-         ref_pts.push_back(notused[ind]);
-         tgt_pts.push_back(indices[0]);
+template <typename PointT>
+void Icp2D<PointT>::workerLoop(Worker *worker){
+   while(true){
+      {
+         boost::mutex::scoped_lock lock(poolmutex_);
+         while(!stopping_ && generation_==worker->generation)
+            workready_.wait(lock);
+         if(stopping_) return;
+         worker->generation=generation_;
       }
-      notused[ind]=notused[indsleft-1];
-      tcount++;
-      indsleft--;
+      if(worker->targetversion!=targetversion_){
+         worker->tree.setInputCloud(target_);
+         worker->targetversion=targetversion_;
+      }
+      matchRange(worker->tree,batchcloud_,worker->begin,worker->end,batchthresh_);
+      boost::mutex::scoped_lock lock(poolmutex_);
+      if(--pending_==0) workdone_.notify_one();
    }
-//   ROS_INFO("finding Closest Points took:  %f secs. found %d pts from %d guesses out of %d pts",g_tock(t0),tgt_pts.size(),tcount,target_cloud.points.size());
-//   ROS_INFO(" %f secs pre guess",g_tock(t0)/(double)tcount);
-   return 0;
 }
 
+template <typename PointT>
+void Icp2D<PointT>::stopWorkers(){
+   {
+      boost::mutex::scoped_lock lock(poolmutex_);
+      stopping_=true;
+   }
+   workready_.notify_all();
+   for(uint w=0;w<workers_.size();w++)
+      workers_[w]->thread->join();
+   workers_.clear();
+   stopping_=false;
+}
 
+template <typename PointT>
+void Icp2D<PointT>::matchParallel(const pcl::PointCloud<PointT> *ref_cloud, int batch, int numthreads, double dist_thresh){
+   //the pool grows to the most threads a batch has needed. a smaller batch leaves the extra workers an empty share
+   while((int)workers_.size() < numthreads-1){
+      boost::shared_ptr<Worker> worker(new Worker);
+      worker->generation=generation_;
+      worker->targetversion=-1;
+      worker->begin=worker->end=0;
+      workers_.push_back(worker);
+      worker->thread.reset(new boost::thread(boost::bind(&Icp2D<PointT>::workerLoop,this,worker.get())));
+   }
+   int threads=std::min(numthreads,(int)workers_.size()+1);
+   {
+      boost::mutex::scoped_lock lock(poolmutex_);
+      batchcloud_=ref_cloud;
+      batchthresh_=dist_thresh;
+      for(uint w=0;w<workers_.size();w++){
+         int t=std::min<int>(w+1,threads);
+         workers_[w]->begin=t*batch/threads;
+         workers_[w]->end=std::min<int>(w+2,threads)*batch/threads;
+      }
+      pending_=workers_.size();
+      generation_++;
+   }
+   workready_.notify_all();
+   //the calling thread takes the first share
+   matchRange(tree_,ref_cloud,0,batch/threads,dist_thresh);
+   boost::mutex::scoped_lock lock(poolmutex_);
+   while(pending_>0)
+      workdone_.wait(lock);
+}
 
+//ref should map to target, but not necessarily the other way 'round.  also, target should not be downsampled
 template <typename PointT>
-Eigen::Matrix4f icp2Dt(pcl::PointCloud<PointT> &c1, pcl::PointCloud<PointT> &c2, double max_dist,
-      int small_transdiff_countreq=1, int num_pts=500, uint min_pts=10, uint max_iter=50, float transdiff_thresh=.0001 ){
+int Icp2D<PointT>::getClosestPoints(const pcl::PointCloud<PointT> &ref_cloud, double dist_thresh, uint num_pts){
+   int numthreads=(numthreads_>0 ? numthreads_ : std::max(1u,boost::thread::hardware_concurrency()));
+   const int minperthread=128; //fewer searches than this are not worth a thread
+   refpts.clear();
+   tgtpts.clear();
+
+   notused_.resize(ref_cloud.points.size());
+   for(uint i=0;i<ref_cloud.points.size();i++)
+      notused_[i]=i;
+   int indsleft=ref_cloud.points.size();
+   while(refpts.size() < num_pts && indsleft > 10){
+      //draw a batch of points without replacement, a little more than we still need in case some don't match
+      int need=num_pts-refpts.size();
+      int batch=std::min(need+need/4+32,indsleft-10);
+      candidates_.resize(batch);
+      for(int k=0;k<batch;k++){
+         int ind=rng_()%indsleft;
+         candidates_[k]=notused_[ind];
+         notused_[ind]=notused_[indsleft-1];
+         indsleft--;
+      }
+      //search for them all, split across threads
+      matches_.resize(batch);
+      //a worker's tree costs about as much to build as searching for as many points as the target holds,
+      //so the workers only take a share once this target has been searched that much
+      int threads=std::min(numthreads,batch/minperthread);
+      if(searched_ < (long)target_->points.size()) threads=1;
+      searched_+=batch;
+      if(threads<=1)
+         matchRange(tree_,&ref_cloud,0,batch,dist_thresh);
+      else
+         matchParallel(&ref_cloud,batch,threads,dist_thresh);
+      //keep the matches in the order they were drawn, so the result does not depend on the threads
+      for(int k=0;k<batch && refpts.size() < num_pts;k++)
+         if(matches_[k]!=-1){
+            refpts.push_back(candidates_[k]);
+            tgtpts.push_back(matches_[k]);
+         }
+   }
+   return refpts.size();
+}
+
+template <typename PointT>
+Eigen::Matrix4f Icp2D<PointT>::align(pcl::PointCloud<PointT> &c1, double max_dist,
+      int small_transdiff_countreq, int num_pts, uint min_pts, uint max_iter, float transdiff_thresh){
    timeval t0=g_tick(),t1=g_tick();
-   std::vector<int> c1pts,c2pts;
    Eigen::Matrix4f transformation_, final_transformation_=Eigen::Matrix4f::Identity(),previous_transformation_,trans2d;
    int small_transdiff_count=0;
    for(uint i=0;i<max_iter;i++){
       t0=g_tick();
-      getClosestPoints(c1,c2,c1pts,c2pts,max_dist,num_pts);
-      if(c1pts.size() < min_pts){
+      getClosestPoints(c1,max_dist,num_pts);
+      if(refpts.size() < min_pts){
          ROS_ERROR("not enough correspondences");
-         return transformation_;
+         return final_transformation_;
       }
       previous_transformation_ = final_transformation_;
-      pcl::estimateRigidTransformationSVD(c1,c1pts,c2,c2pts,transformation_);
+      pcl::estimateRigidTransformationSVD(c1,refpts,*target_,tgtpts,transformation_);
       // Tranform the data
 
-      transformPointCloud (c1, c1, projectTo2D(transformation_));
+      icpTransform(c1,projectTo2D(transformation_));
       // Obtain the final transformation
       final_transformation_ = transformation_ * final_transformation_;
       trans2d=projectTo2D(final_transformation_);
@@ -172,50 +280,156 @@ Eigen::Matrix4f icp2Dt(pcl::PointCloud<PointT> &c1, pcl::PointCloud<PointT> &c2,
    return final_transformation_;
 }
 
+template class Icp2D<pcl::PointXYZ>;
+template class Icp2D<pcl::PointXYZINormal>;
+template class Icp2D<pcl::PointWithViewpoint>;
 
-Eigen::Matrix4f icp2D(pcl::PointCloud<pcl::PointXYZINormal> &c1, pcl::PointCloud<pcl::PointXYZINormal> &c2, double max_dist,
-      int small_transdiff_countreq, int num_pts, uint min_pts, uint max_iter, float transdiff_thresh){
-   timeval t0=g_tick(),t1=g_tick();
-   std::vector<int> c1pts,c2pts;
-   Eigen::Matrix4f transformation_, final_transformation_=Eigen::Matrix4f::Identity(),previous_transformation_,trans2d;
-   int small_transdiff_count=0;
+
+Eigen::Matrix4f icp2DPointToPlane(Icp2D<pcl::PointXYZINormal> &icp, pcl::PointCloud<pcl::PointXYZINormal> &c1, double max_dist,
+      int num_pts, uint min_pts, uint max_iter, float transdiff_thresh){
+   timeval t0=g_tick();
+   const pcl::PointCloud<pcl::PointXYZINormal> &target=icp.getTarget();
+   Eigen::Matrix4f step, final_transformation_=Eigen::Matrix4f::Identity();
    for(uint i=0;i<max_iter;i++){
-      t0=g_tick();
-      getClosestPoints(c1,c2,c1pts,c2pts,max_dist,num_pts);
-      if(c1pts.size() < min_pts){
+      icp.getClosestPoints(c1,max_dist,num_pts);
+      if(icp.refpts.size() < min_pts){
          ROS_ERROR("not enough correspondences");
-         return transformation_;
+         return final_transformation_;
       }
-      previous_transformation_ = final_transformation_;
-      pcl::estimateRigidTransformationSVD(c1,c1pts,c2,c2pts,transformation_);
-      // Tranform the data
-
-      transformPointCloudWithNormals (c1, c1, projectTo2D(transformation_));
-      // Obtain the final transformation
-      final_transformation_ = transformation_ * final_transformation_;
-      trans2d=projectTo2D(final_transformation_);
-      final_transformation_=trans2d;
-      float transdiff=fabs ((final_transformation_ - previous_transformation_).sum ());
-      ROS_INFO("icp took:  %f secs. trans diff: %f,  total: %f, %f, %f",g_tock(t0),transdiff,trans2d(0,3),trans2d(1,3),getYaw(trans2d));
-      if(transdiff <transdiff_thresh) small_transdiff_count++;
-      else small_transdiff_count=0;
-      if(small_transdiff_count>small_transdiff_countreq)
+      //the distance from p to q's plane, after a small move (tx,ty,yaw), is about
+      //(p-q).n + tx*nx + ty*ny + yaw*(px*ny - py*nx).  Solve the least squares normal equations for the move
+      Eigen::Matrix3d JtJ=Eigen::Matrix3d::Zero();
+      Eigen::Vector3d Jtr=Eigen::Vector3d::Zero();
+      for(uint k=0;k<icp.refpts.size();++k){
+         const pcl::PointXYZINormal &p=c1.points[icp.refpts[k]], &q=target.points[icp.tgtpts[k]];
+         double nx=q.normal[0], ny=q.normal[1], nz=q.normal[2];
+         Eigen::Vector3d J(nx,ny,p.x*ny-p.y*nx);
+         double r=(p.x-q.x)*nx+(p.y-q.y)*ny+(p.z-q.z)*nz;
+         JtJ+=J*J.transpose();
+         Jtr+=J*r;
+      }
+      //if the normals are all vertical, or all face one way, some direction of the move is not pinned down
+      if(fabs(JtJ.determinant()) < 1e-12*icp.refpts.size()*icp.refpts.size()*icp.refpts.size()){
+         ROS_ERROR("point to plane icp: the target normals do not constrain x, y and yaw");
+         return final_transformation_;
+      }
+      Eigen::Vector3d x=JtJ.ldlt().solve(-Jtr);
+      double c=cos(x(2)), s=sin(x(2));
+      step=Eigen::Matrix4f::Identity();
+      step(0,0)=c; step(0,1)=-s;
+      step(1,0)=s; step(1,1)=c;
+      step(0,3)=x(0); step(1,3)=x(1);
+      icpTransform(c1,step);
+      final_transformation_=step*final_transformation_;
+      if(fabs(x(0))+fabs(x(1))+fabs(x(2)) < transdiff_thresh)
          break;
    }
-   ROS_INFO("icp took:  %f secs. ",g_tock(t1));
-   std::cout<<final_transformation_<<std::endl;
+   ROS_INFO("point to plane icp took:  %f secs. total: %f, %f, %f",g_tock(t0),final_transformation_(0,3),final_transformation_(1,3),getYaw(final_transformation_));
    return final_transformation_;
 }
 
+Eigen::Matrix4f icp2DPointToPlane(pcl::PointCloud<pcl::PointXYZINormal> &c1, pcl::PointCloud<pcl::PointXYZINormal> &c2, double max_dist,
+      int num_pts, uint min_pts, uint max_iter, float transdiff_thresh){
+   Icp2D<pcl::PointXYZINormal> icp;
+   icp.setTarget(c2);
+   return icp2DPointToPlane(icp,c1,max_dist,num_pts,min_pts,max_iter,transdiff_thresh);
+}
+
+
+//ref should map to target, but not necessarily the other way 'round.  also, target should not be downsampled
+//this builds a tree over target for just this call.  To match against the same target more than once, use Icp2D
+template <typename PointT>
+int getClosestPoints(pcl::PointCloud<PointT> &ref_cloud, pcl::PointCloud<PointT> &target_cloud, std::vector<int> &ref_pts, std::vector<int> &tgt_pts, double dist_thresh=.2, uint num_pts=500){
+   Icp2D<PointT> icp;
+   icp.setTarget(target_cloud);
+   icp.getClosestPoints(ref_cloud,dist_thresh,num_pts);
+   ref_pts.swap(icp.refpts);
+   tgt_pts.swap(icp.tgtpts);
+   return 0;
+}
+
+
+//one-off ICP of c1 onto c2.  c2's tree is built once for all the iterations; keep an Icp2D around to reuse it across calls
+template <typename PointT>
+Eigen::Matrix4f icp2Dt(pcl::PointCloud<PointT> &c1, pcl::PointCloud<PointT> &c2, double max_dist,
+      int small_transdiff_countreq=1, int num_pts=500, uint min_pts=10, uint max_iter=50, float transdiff_thresh=.0001 ){
+   Icp2D<PointT> icp;
+   icp.setTarget(c2);
+   return icp.align(c1,max_dist,small_transdiff_countreq,num_pts,min_pts,max_iter,transdiff_thresh);
+}
+
+
+Eigen::Matrix4f icp2D(pcl::PointCloud<pcl::PointXYZINormal> &c1, pcl::PointCloud<pcl::PointXYZINormal> &c2, double max_dist,
+      int small_transdiff_countreq, int num_pts, uint min_pts, uint max_iter, float transdiff_thresh){
+   return icp2Dt(c1,c2,max_dist,small_transdiff_countreq,num_pts,min_pts,max_iter,transdiff_thresh);
+}
+
+template <typename PointT>
+void NearestPoints<PointT>::setInputCloud(const pcl::PointCloud<PointT> &cloud){
+   setInputCloud(typename pcl::PointCloud<PointT>::ConstPtr(cloud.makeShared()));
+}
+
+template <typename PointT>
+void NearestPoints<PointT>::setInputCloud(const typename pcl::PointCloud<PointT>::ConstPtr &cloud){
+   cloud_=cloud;
+   tree_.setInputCloud(cloud_);
+}
+
+template <typename PointT>
+int NearestPoints<PointT>::nearest(const PointT &ref, float &sqrdist){
+   indices_.resize(1);
+   dists_.resize(1);
+   if(!cloud_->points.size() || !tree_.nearestKSearch(ref,1,indices_,dists_)){
+      sqrdist=std::numeric_limits<float>::infinity();
+      return -1;
+   }
+   sqrdist=dists_[0];
+   return indices_[0];
+}
+
+template <typename PointT>
+double NearestPoints<PointT>::nearest(const PointT &ref, PointT &point){
+   float sqrdist;
+   int ind=nearest(ref,sqrdist);
+   if(ind!=-1) point=cloud_->points[ind];
+   return sqrdist;
+}
+
+template <typename PointT>
+void NearestPoints<PointT>::nearest(const pcl::PointCloud<PointT> &refs, std::vector<int> &indices, std::vector<float> &sqrdists){
+   indices.resize(refs.points.size());
+   sqrdists.resize(refs.points.size());
+   for(uint i=0;i<refs.points.size();i++)
+      indices[i]=nearest(refs.points[i],sqrdists[i]);
+}
+
+template <typename PointT>
+void NearestPoints<PointT>::nearestK(const pcl::PointCloud<PointT> &refs, int k, std::vector<int> &indices, std::vector<float> &sqrdists){
+   indices.assign(refs.points.size()*k,-1);
+   sqrdists.assign(refs.points.size()*k,std::numeric_limits<float>::infinity());
+   int kk=std::min(k,(int)cloud_->points.size());
+   if(kk<=0) return;
+   indices_.resize(kk);
+   dists_.resize(kk);
+   for(uint i=0;i<refs.points.size();i++){
+      int found=tree_.nearestKSearch(refs.points[i],kk,indices_,dists_);
+      for(int j=0;j<found && j<kk;j++){
+         indices[i*k+j]=indices_[j];
+         sqrdists[i*k+j]=dists_[j];
+      }
+   }
+}
+
+template class NearestPoints<pcl::PointXYZ>;
+template class NearestPoints<pcl::PointXYZINormal>;
+template class NearestPoints<pcl::PointWithViewpoint>;
+
+//a one-off query.  to ask about more than one point, keep a NearestPoints around instead
 template <typename PointT>
 double getClosestPointt(pcl::PointCloud<PointT> &cloud, PointT ref, PointT &point){
-   pcl::KdTreeFLANN<PointT> tree;
-   tree.setInputCloud(cloud.makeShared());
-   std::vector<int> ind(20);
-   std::vector<float> dists(20);
-   tree.nearestKSearch(ref,1,ind,dists);
-   point=cloud.points[ind[0]];
-   return dists[0];
+   NearestPoints<PointT> query;
+   query.setInputCloud(typename pcl::PointCloud<PointT>::ConstPtr(&cloud,NullDeleter())); //query does not outlive cloud
+   return query.nearest(ref,point);
 }
 
 template <typename PointT>
@@ -265,6 +479,54 @@ void downSamplet(pcl::PointCloud<PointT> &cloudin, pcl::PointCloud<PointT> &clou
    std::cout<<"downsampling took:  "<<g_tock(t0)<<"  for "<<cloudout.points.size()<<" indices."<<std::endl;
 }
 
+//voxel downsample for one level of Icp2DPyramid.  a leaf size of 0 leaves the cloud as it is
+template <typename PointT>
+void pyramidLevel(const pcl::PointCloud<PointT> &cloudin, pcl::PointCloud<PointT> &cloudout, double leafsize){
+   if(leafsize<=0){
+      cloudout=cloudin;
+      return;
+   }
+   pcl::VoxelGrid<PointT> sor;
+   sor.setInputCloud (cloudin.makeShared());
+   sor.setLeafSize (leafsize, leafsize, leafsize);
+   sor.filter (cloudout);
+}
+
+template <typename PointT>
+void Icp2DPyramid<PointT>::setTarget(const pcl::PointCloud<PointT> &target, const std::vector<double> &leafsizes){
+   leafsizes_=leafsizes;
+   levels_.resize(leafsizes.size());
+   for(uint l=0;l<leafsizes.size();l++){
+      typename pcl::PointCloud<PointT>::Ptr down(new pcl::PointCloud<PointT>);
+      pyramidLevel(target,*down,leafsizes[l]);
+      levels_[l].reset(new Icp2D<PointT>);
+      levels_[l]->setTarget(typename pcl::PointCloud<PointT>::ConstPtr(down));
+   }
+}
+
+template <typename PointT>
+Eigen::Matrix4f Icp2DPyramid<PointT>::align(pcl::PointCloud<PointT> &c1, double max_dist, int small_transdiff_countreq,
+      int num_pts, uint min_pts, uint max_iter, uint fine_iter, float transdiff_thresh){
+   timeval t0=g_tick();
+   Eigen::Matrix4f final_transformation_=Eigen::Matrix4f::Identity();
+   double dist=max_dist;
+   for(uint l=0;l<levels_.size();l++,dist/=2.0){
+      //start this level from where the coarser ones got to
+      pyramidLevel(c1,source_,leafsizes_[l]);
+      icpTransform(source_,final_transformation_);
+      uint iters=(l+1==levels_.size() ? fine_iter : max_iter);
+      Eigen::Matrix4f trans=levels_[l]->align(source_,dist,small_transdiff_countreq,num_pts,min_pts,iters,transdiff_thresh);
+      final_transformation_=projectTo2D(trans*final_transformation_);
+   }
+   icpTransform(c1,final_transformation_);
+   ROS_INFO("pyramid icp took:  %f secs. total: %f, %f, %f",g_tock(t0),final_transformation_(0,3),final_transformation_(1,3),getYaw(final_transformation_));
+   return final_transformation_;
+}
+
+template class Icp2DPyramid<pcl::PointXYZ>;
+template class Icp2DPyramid<pcl::PointXYZINormal>;
+template class Icp2DPyramid<pcl::PointWithViewpoint>;
+
 void myFlipNormals(double vx, double vy, double vz, pcl::PointCloud<pcl::PointXYZINormal> &ncloud){
    for(uint i=0;i<ncloud.points.size();i++){
       pcl::PointXYZINormal p=ncloud.points[i];
@@ -330,135 +592,9 @@ double ptdist(PointT a,PointT b){
 
 template <typename PointT>
 void segfastt(pcl::PointCloud<PointT> &cloud, std::vector<pcl::PointCloud<PointT> > &cloud_clusters, double cluster_tol=.2){
-   double smaller_tol = cluster_tol/2.3;
-   timeval t0=g_tick();
-   pcl::KdTreeFLANN<PointT> tree,tree2;
-   tree.setInputCloud(cloud.makeShared());
-   std::vector<int> minitree(cloud.points.size(),-1);
-   std::vector<int> heads,indices;
-   std::vector<float> dists;
-
-   //First 'downsample' the points into clusters slightly less than half the cluster tolerance
-   //minitree keeps track of who each point belongs to (which is an index of the 'head' array)
-   for(uint i=0; i<cloud.points.size();i++){
-     if(minitree[i]==-1){    //if no one has claimed this point, make it a head
-        heads.push_back(i);
-        if(!tree.radiusSearch(cloud,i,smaller_tol,indices,dists))  //find all the points close to this point
-        	std::cout<<"radius search failed!"<<std::endl;
-        for(uint j=0;j<indices.size();j++){
-           minitree[indices[j]]=heads.size()-1; //assign these points to the current head.
-                                       // this overwrites previous claims, but it's ok
-        }
-     }
-   }
-// std::cout<<"radiusSearch took:  "<<g_tock(t0)<<"s  found "<<heads.size()<<" heads"<<std::endl;
-
-   //now, we have much fewer points to cluster, but since the initial downsampling was less than
-   //half the cluster tolerance,we are guaranteed to find all the points within the tolerance
-   //(except if  [ clustertol < distance between heads < cluster_tol+ smaller cluster tol] AND the head closest points in the two heads are < cluster_tol
-   //I need to make something to deal with that...
-   tree2.setInputCloud(cloud.makeShared(),boost::make_shared<std::vector<int> >  (heads));
-   int searching,currenthead;
-   //heads2 is the cluster id.  we now search to make sure we check all the points in our cluster
-   //minitree2 corresponds to the heads array, so the points in minitree2 are at heads[i]
-   std::vector<int> heads2, minitree2(heads.size(),-1);
-   std::list<int> tosearch;
-   for(uint i=0; i<minitree2.size();i++){
-     if(minitree2[i]==-1){
-        heads2.push_back(heads[i]);
-        tosearch.push_back(i);
-        currenthead=heads2.size()-1; //references an index in heads2
-        minitree2[i]=currenthead;
-        while(tosearch.size()>0){
-           searching=tosearch.front();
-           tosearch.pop_front();
-           if(!tree2.radiusSearch(cloud.points[heads[searching]],cluster_tol,indices,dists))
-        	   std::cout<<"radius search failed!"<<std::endl;
-//         cout<<i<<" --> "<<searching<<" --> "<<indices.size()<<std::endl;
-           for(uint j=0;j<indices.size();j++)
-              if(minitree2[indices[j]]==-1){//found untouched point (which means this root touched it)
-                 minitree2[indices[j]]=currenthead; //claim it
-                 tosearch.push_back(indices[j]);   //add it to list of points to search
-              }
-        }
-     }
-
-   }
-
-   timeval t1=g_tick();
-   std::vector<int> indices1;
-   std::vector<float> dists1;
-   std::vector<int> deletedclusters;
-   //now we need to check to see if any of the heads that were NOT clustered together are closer than cluster_tol+smaller_tol:
-   for(uint i=0; i<minitree2.size();i++){
-      tree2.radiusSearch(cloud.points[heads[i]],cluster_tol+smaller_tol,indices,dists);
-      for(uint j=0;j<indices.size();j++)
-         if(minitree2[indices[j]] != minitree2[i] && i<j){//if the two heads are not in the same cluster
-        	 std::cout<<"head "<<i<<" ("<<minitree2[i]<<") is "<<sqrt(dists[j])<<" from head "<<indices[j]<<" ("<<minitree2[indices[j]]<<")"<<std::endl;
-            //now we have to find if there is a point between head a and head b that is < cluster_tol from both
-            PointT heada=cloud.points[heads[i]], headb=cloud.points[heads[indices[j]]];
-            PointT inbetween;
-            inbetween.x=(heada.x+headb.x)/2.0;
-            inbetween.y=(heada.y+headb.y)/2.0;
-            inbetween.z=(heada.z+headb.z)/2.0;
-
-            tree.radiusSearch(inbetween,cluster_tol,indices1,dists1); //search in the full tree
-            double distthresh=cluster_tol*cluster_tol; //radius search gives squared distances...
-            for(uint k=0;k<indices1.size();k++){
-               if(ptdist(cloud.points[indices1[k]],heada ) < distthresh && ptdist(cloud.points[indices1[k]],headb ) < distthresh ){
-                  //there is a point that these two clusters share -> they should be merged
-            	   std::cout<<"head "<<i<<" ("<<minitree2[i]<<") shares "<<indices1[k]<<" with head "<<indices[j]<<" ("<<minitree2[indices[j]]<<")"<<std::endl;
-                  //rename all heads in cluster b to cluster a
-                  int clusterb=minitree2[indices[j]];
-                  for(uint m=0;m<minitree2.size();m++){
-                     if(minitree2[m]==clusterb) minitree2[m]=minitree2[i];
-                  }
-                  deletedclusters.push_back(clusterb);
-                  break;
-               }
-
-            }
-
-         }
-   }
-
-   std::cout<<"checking overlaps took:  "<<g_tock(t1)<<"s  found "<<deletedclusters.size()<<" overlaps"<<std::endl;
-
-
-
-
-
-   std::cout<<"radiusSearch took:  "<<g_tock(t0)<<"s  found "<<heads2.size()<<" heads"<<std::endl;
-   std::vector<std::vector<int> > clusters(heads2.size());
-   //now, for each point in the cloud find it's head --> then the head it clustered to. that is it's cluster id!
-   for(uint j=0;j<minitree.size();j++){
-     clusters[minitree2[minitree[j]]].push_back(j);
-   }
-
-
-   std::cout<<"clustering took:  "<<g_tock(t0)<<"s  found "<<heads2.size()<<" heads"<<std::endl;
-   for(uint j=0;j<heads2.size();j++){
-	   std::cout<<"cluster "<<j<<"  -->  "<<clusters[j].size()<<std::endl;
-   }
-
-   //erase the deleted clusters
-   bool loop=true;
-   while(loop){
-      loop=false;
-      for(uint i=0;i<clusters.size(); i++)
-         if(clusters[i].size()==0){
-            clusters.erase(clusters.begin()+i);
-            loop=true;
-         }
-
-
-   }
-
-   cloud_clusters.resize(clusters.size());
-   for(uint i=0;i<clusters.size(); i++){
-     getSubCloud(cloud,clusters[i],cloud_clusters[i]);
-   }
-
+   EuclideanClusterEngine<PointT,KdIndex<PointT>,GrabSeeds,ExactMerge> engine(GrabSeeds(2.3));
+   ClusterCloudSink<PointT> sink(cloud_clusters);
+   engine.cluster(cloud,sink,cluster_tol);
 }
 
 
@@ -534,13 +670,13 @@ void downSample(pcl::PointCloud<pcl::PointWithViewpoint> &cloudin, pcl::PointClo
 
 
 void segfast(pcl::PointCloud<pcl::PointXYZ> &cloud, std::vector<pcl::PointCloud<pcl::PointXYZ> > &cloud_clusters, double cluster_tol){
-   segfast(cloud,cloud_clusters,cluster_tol);
+   segfastt(cloud,cloud_clusters,cluster_tol);
 }
 void segfast(pcl::PointCloud<pcl::PointXYZINormal> &cloud, std::vector<pcl::PointCloud<pcl::PointXYZINormal> > &cloud_clusters, double cluster_tol){
-   segfast(cloud,cloud_clusters,cluster_tol);
+   segfastt(cloud,cloud_clusters,cluster_tol);
 }
 void segfast(pcl::PointCloud<pcl::PointWithViewpoint> &cloud, std::vector<pcl::PointCloud<pcl::PointWithViewpoint> > &cloud_clusters, double cluster_tol){
-   segfast(cloud,cloud_clusters,cluster_tol);
+   segfastt(cloud,cloud_clusters,cluster_tol);
 }
 
 
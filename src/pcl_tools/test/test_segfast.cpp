@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+#include <limits>
+#include <set>
+#include "pcl_tools/segfast.hpp"
+
+typedef pcl::PointCloud<pcl::PointXYZ> Cloud;
+
+//the clusters as a set of sets, so clusterings can be compared regardless of the order they come out in
+std::set<std::set<int> > asSets(const std::vector<std::vector<int> > &clusters){
+   std::set<std::set<int> > sets;
+   for(uint c=0;c<clusters.size();++c)
+      sets.insert(std::set<int>(clusters[c].begin(),clusters[c].end()));
+   return sets;
+}
+
+void addPoint(Cloud &cloud, float x, float y, float z){
+   pcl::PointXYZ p;
+   p.x=x; p.y=y; p.z=z;
+   cloud.points.push_back(p);
+}
+
+//two lines of points along x, long enough to be cut into slabs: one unbroken, one with a gap in the middle.
+//some points have bad coordinates, as kinect clouds always do
+void makeLines(Cloud &cloud, std::vector<int> &badpts){
+   float nan=std::numeric_limits<float>::quiet_NaN();
+   for(int i=0;i<2000;++i){
+      addPoint(cloud,i*.002,0,0);
+      if(i<990 || i>=1010) addPoint(cloud,i*.002,1,0);
+      if(i%250==0){
+         badpts.push_back(cloud.points.size());
+         addPoint(cloud,nan,nan,nan);
+         badpts.push_back(cloud.points.size());
+         addPoint(cloud,i*.002,nan,0);  //right by the slab borders along x, but not a point
+      }
+   }
+   cloud.width=cloud.points.size();
+   cloud.height=1;
+}
+
+TEST(SegfastParallel, SameAsSegfast){
+   Cloud cloud;
+   std::vector<int> badpts;
+   makeLines(cloud,badpts);
+   std::vector<std::vector<int> > serial,parallel;
+   segfast(cloud,serial,.01);
+   segfastParallel(cloud,parallel,.01,ClusterLimits(),4);
+   EXPECT_EQ(3u,parallel.size());
+   EXPECT_TRUE(asSets(serial)==asSets(parallel));
+}
+
+TEST(SegfastParallel, LeavesOutBadPoints){
+   Cloud cloud;
+   std::vector<int> badpts;
+   makeLines(cloud,badpts);
+   std::vector<std::vector<int> > clusters;
+   segfastParallel(cloud,clusters,.01,ClusterLimits(),4);
+   uint total=0;
+   for(uint c=0;c<clusters.size();++c){
+      total+=clusters[c].size();
+      for(uint j=0;j<clusters[c].size();++j)
+         EXPECT_TRUE(std::find(badpts.begin(),badpts.end(),clusters[c][j])==badpts.end());
+   }
+   EXPECT_EQ(cloud.points.size()-badpts.size(),total);
+}
+
+//with the tracker's voxels laid out from (0,0,0), a point 2^21 voxels up has a z voxel coordinate that spills into
+//the y bits of the key, and lands it in the voxel one up in y.  it has to stay a cluster of its own
+TEST(SegfastVoxel, FarPointsDoNotShareVoxels){
+   double tol=.02, vsize=tol/sqrt(3.0)*0.999;
+   Cloud cloud;
+   std::vector<int> badpts;
+   makeLines(cloud,badpts);
+   addPoint(cloud,0,1.5*vsize,0);
+   pcl::PointXYZ far;
+   far.x=0;
+   far.y=.5*vsize;
+   far.z=((1<<21)+.5)*vsize;
+   cloud.points.push_back(far);
+   cloud.width=cloud.points.size();
+   std::vector<std::vector<int> > serial,voxel,tracked;
+   std::vector<int> labels;
+   SegfastTracker<pcl::PointXYZ> tracker;
+   segfast(cloud,serial,tol);
+   segfastVoxel(cloud,voxel,tol);
+   segfastTracked(cloud,tracked,labels,tracker,tol);
+   EXPECT_TRUE(asSets(serial)==asSets(voxel));
+   EXPECT_TRUE(asSets(serial)==asSets(tracked));
+}
+
+int main(int argc, char **argv){
+   testing::InitGoogleTest(&argc,argv);
+   return RUN_ALL_TESTS();
+}